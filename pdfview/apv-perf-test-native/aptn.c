@@ -1,17 +1,55 @@
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 
 #include "apvcore.h"
 
 
+/* fitz store size, same order as on devices */
+#define APTN_MAX_STORE (16 * 1024 * 1024)
+
+
+static const char *phase_names[APV_OPEN_PHASES] = {
+    "file",
+    "xref",
+    "repair",
+    "crypt",
+    "linearization",
+    "page tree",
+    "first page"
+};
+
+
 void apv_log_print(const char *file, int line, int level, const char *fmt, ...) {
-    printf("log\n");
+    va_list args;
+    if (level < APV_LOG_WARN) return;
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%d: ", file, line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+
+static void print_open_stats(pdf_t *pdf) {
+    int i = 0;
+    for(i = 0; i < APV_OPEN_PHASES; ++i) {
+        if (!pdf->open_stats[i].done) continue;
+        printf("%-14s %10.3f ms %10lld bytes read\n", phase_names[i],
+                pdf->open_stats[i].time_us / 1000.0, pdf->open_stats[i].read_bytes);
+    }
 }
 
 
 int main(int argc, char *argv[]) {
+    apv_alloc_state_t alloc_state;
+    fz_alloc_context alloc_context;
+    fz_context *ctx = NULL;
     pdf_t *pdf = NULL;
+    fz_pixmap *pixmap = NULL;
     char *filename = NULL;
+    int count = 0;
+    int image_detail = APV_IMAGES_FULL;
 
     if (argc != 2) {
         fprintf(stderr, "usage: aptn filename\n");
@@ -20,26 +58,48 @@ int main(int argc, char *argv[]) {
 
     filename = argv[1];
 
-    pdf = parse_pdf_file(filename, 0, NULL);
-    printf("loaded pdf file\n");
+    alloc_state.current_size = 0;
+    alloc_state.max_size = APTN_MAX_STORE;
+#ifndef NDEBUG
+    alloc_state.peak_size = 0;
+    alloc_state.magic = rand();
+#endif
+    alloc_context.user = &alloc_state;
+    alloc_context.malloc = apv_malloc;
+    alloc_context.realloc = apv_realloc;
+    alloc_context.free = apv_free;
+    ctx = fz_new_context(&alloc_context, apv_new_locks_context(), APTN_MAX_STORE);
+    if (ctx == NULL) {
+        fprintf(stderr, "failed to create fitz context\n");
+        return 1;
+    }
+
+    pdf = parse_pdf_file(filename, -1, "", ctx, &alloc_context, &alloc_state);
+    if (pdf == NULL || pdf->doc == NULL || pdf->invalid_password) {
+        fprintf(stderr, "failed to open %s\n", filename);
+        return 1;
+    }
 
-/*
-fz_pixmap *get_page_image_bitmap(
-        pdf_t *pdf,
-        int pageno, int zoom_pmil,
-        int left, int top, int rotation,
-        int skipImages,
-        int width, int height)
-*/
+    pthread_mutex_lock(&pdf->doc_lock);
+    count = get_page_count(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    printf("loaded pdf file, %d pages, fingerprint %016llx\n", count, pdf->file_id.fingerprint);
+
+    pixmap = get_page_image_bitmap(pdf, ctx, 0, 1000, 0, 0, 0, APV_AA_FULL, &image_detail, 256, 256);
+    if (pixmap) {
+        printf("got pixmap, w: %d, h: %d\n", fz_pixmap_width(ctx, pixmap), fz_pixmap_height(ctx, pixmap));
+        fz_drop_pixmap(ctx, pixmap);
+    } else {
+        printf("failed to render first page\n");
+    }
 
-    fz_pixmap *pixmap = get_page_image_bitmap(pdf, 1, 1000, 0, 0, 0, 0, 256, 256);
-    printf("got pixmap, w: %d, h: %d\n",
-        (int) fz_pixmap_width(pdf->ctx, pixmap),
-        (int) fz_pixmap_height(pdf->ctx, pixmap));
+    print_open_stats(pdf);
 
     free_pdf_t(pdf);
+    fz_free_context(ctx);
 
     return 0;
 }
 
 
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "aptn_util.h"
+
+
+/*
+ * Checks image painter of draw_affine.c against stock mupdf one.
+ *
+ * First paints random images with random transforms, most of them scaled
+ * and flipped but not rotated or rotated by a multiple of 90 degrees, some
+ * at other angles, with both versions and compares whole destination and
+ * shape pixmaps. Images are rgb, gray on rgb, and masks painted in color.
+ * Then times both versions painting a scan sized image into tiles, upright
+ * and rotated by 90 degrees.
+ */
+
+
+/* stock draw_affine.c, built with exported functions renamed */
+void stock_fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha);
+void stock_fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, unsigned char *colorbv);
+
+
+#define CHECK_W 200
+#define CHECK_H 150
+#define BENCH_W 1240
+#define BENCH_H 1754
+#define BENCH_TILE 256
+
+
+static const char *bench_names[] = { "upright", "90 deg" };
+
+
+/**
+ * Fills pixmap with random premultiplied pixels, some of them opaque and
+ * some fully transparent.
+ */
+static void fill_random(fz_pixmap *pix) {
+    int n = pix->n;
+    int i = 0, k = 0;
+    for(i = 0; i < pix->w * pix->h; ++i) {
+        unsigned char *p = &pix->samples[i * n];
+        int a = aptn_rnd() % 3 == 0 ? 255 : aptn_rnd() % 5 == 0 ? 0 : aptn_rnd() % 256;
+        for(k = 0; k < n - 1; ++k) p[k] = a ? aptn_rnd() % (a + 1) : 0;
+        p[n - 1] = a;
+    }
+}
+
+
+/**
+ * Random image transform of w by h image placed around the middle of check
+ * area.
+ */
+static void random_ctm(fz_matrix *ctm, int w, int h) {
+    int kind = aptn_rnd() % 8;
+    fz_matrix rotation;
+    float sx = aptn_rnd_float(0.3f, 2.5f) * w * (aptn_rnd() % 4 == 0 ? -1 : 1);
+    float sy = aptn_rnd_float(0.3f, 2.5f) * h * (aptn_rnd() % 4 == 0 ? -1 : 1);
+    if (aptn_rnd() % 3 == 0) {
+        /* whole pixels, like images prescaled by draw device */
+        sx = (int)sx + (sx < 0 ? -1 : 1);
+        sy = (int)sy + (sy < 0 ? -1 : 1);
+    }
+    if (kind < 4) {
+        /* up to 3 right angles */
+        float a = kind * 90;
+        fz_scale(ctm, sx, sy);
+        fz_concat(ctm, ctm, fz_rotate(&rotation, a));
+    } else if (kind < 7) {
+        fz_scale(ctm, sx, sy);
+    } else {
+        fz_scale(ctm, sx, sy);
+        fz_concat(ctm, ctm, fz_rotate(&rotation, aptn_rnd_float(0, 360)));
+    }
+    ctm->e = aptn_rnd_float(-50, CHECK_W + 50);
+    ctm->f = aptn_rnd_float(-50, CHECK_H + 50);
+    if (aptn_rnd() % 2) {
+        ctm->e = floorf(ctm->e);
+        ctm->f = floorf(ctm->f);
+    }
+}
+
+
+/**
+ * Paints random image with both versions, returns 0 on mismatch.
+ */
+static int check(fz_context *ctx, int number) {
+    int kind = aptn_rnd() % 4;
+    int iw = 1 + aptn_rnd() % 60;
+    int ih = 1 + aptn_rnd() % 60;
+    int alpha = aptn_rnd() % 3 == 0 ? aptn_rnd() % 256 : 255;
+    int with_shape = aptn_rnd() % 3 == 0;
+    fz_colorspace *dst_cs = fz_device_rgb(ctx);
+    fz_colorspace *img_cs = NULL;
+    fz_pixmap *img = NULL;
+    fz_pixmap *dst = NULL;
+    fz_pixmap *stock_dst = NULL;
+    fz_pixmap *shape = NULL;
+    fz_pixmap *stock_shape = NULL;
+    unsigned char color[FZ_MAX_COLORS];
+    fz_matrix ctm;
+    fz_irect scissor;
+    int ok = 0;
+    int k = 0;
+
+    switch (kind) {
+    case 0: img_cs = fz_device_rgb(ctx); break;
+    case 1: img_cs = fz_device_gray(ctx); break; /* gray on rgb */
+    case 2: img_cs = fz_device_gray(ctx); dst_cs = fz_device_gray(ctx); break;
+    default: img_cs = NULL; break; /* mask painted in color */
+    }
+    img = fz_new_pixmap(ctx, img_cs, iw, ih);
+    fill_random(img);
+    if (aptn_rnd() % 4 == 0) img->interpolate = 0;
+    dst = fz_new_pixmap(ctx, dst_cs, CHECK_W, CHECK_H);
+    dst->x = aptn_rnd() % 100 - 50;
+    dst->y = aptn_rnd() % 100 - 50;
+    fill_random(dst);
+    stock_dst = fz_new_pixmap(ctx, dst_cs, CHECK_W, CHECK_H);
+    stock_dst->x = dst->x;
+    stock_dst->y = dst->y;
+    memcpy(stock_dst->samples, dst->samples, dst->w * dst->h * dst->n);
+    if (with_shape) {
+        shape = fz_new_pixmap(ctx, NULL, CHECK_W - aptn_rnd() % 40, CHECK_H - aptn_rnd() % 40);
+        shape->x = dst->x + aptn_rnd() % 40;
+        shape->y = dst->y + aptn_rnd() % 40;
+        fill_random(shape);
+        stock_shape = fz_new_pixmap(ctx, NULL, shape->w, shape->h);
+        stock_shape->x = shape->x;
+        stock_shape->y = shape->y;
+        memcpy(stock_shape->samples, shape->samples, shape->w * shape->h);
+    }
+    scissor.x0 = dst->x + aptn_rnd() % 60;
+    scissor.y0 = dst->y + aptn_rnd() % 60;
+    scissor.x1 = dst->x + CHECK_W - aptn_rnd() % 60;
+    scissor.y1 = dst->y + CHECK_H - aptn_rnd() % 60;
+    for(k = 0; k < FZ_MAX_COLORS; ++k) color[k] = aptn_rnd();
+
+    random_ctm(&ctm, iw, ih);
+    ctm.e += dst->x;
+    ctm.f += dst->y;
+    if (kind == 3) {
+        fz_paint_image_with_color(dst, &scissor, shape, img, &ctm, color);
+        stock_fz_paint_image_with_color(stock_dst, &scissor, stock_shape, img, &ctm, color);
+    } else {
+        fz_paint_image(dst, &scissor, shape, img, &ctm, alpha);
+        stock_fz_paint_image(stock_dst, &scissor, stock_shape, img, &ctm, alpha);
+    }
+
+    ok = memcmp(dst->samples, stock_dst->samples, dst->w * dst->h * dst->n) == 0;
+    if (with_shape && memcmp(shape->samples, stock_shape->samples, shape->w * shape->h) != 0) ok = 0;
+    if (!ok) {
+        printf("mismatch: kind %d, %d x %d image, ctm %g %g %g %g %g %g, alpha %d\n",
+                kind, iw, ih, ctm.a, ctm.b, ctm.c, ctm.d, ctm.e, ctm.f, alpha);
+    }
+
+    fz_drop_pixmap(ctx, img);
+    fz_drop_pixmap(ctx, dst);
+    fz_drop_pixmap(ctx, stock_dst);
+    if (shape) fz_drop_pixmap(ctx, shape);
+    if (stock_shape) fz_drop_pixmap(ctx, stock_shape);
+    return ok;
+}
+
+
+/**
+ * Times count paintings of opaque scan sized image, like scanned pages, at its
+ * own size into tiles covering it, returns seconds.
+ */
+static double bench(fz_context *ctx, int rotate, int stock, int count) {
+    fz_pixmap *img = fz_new_pixmap(ctx, fz_device_rgb(ctx), BENCH_W, BENCH_H);
+    fz_pixmap *tile = fz_new_pixmap(ctx, fz_device_rgb(ctx), BENCH_TILE, BENCH_TILE);
+    fz_matrix ctm;
+    fz_matrix rotation;
+    int w = rotate ? img->h : img->w;
+    int h = rotate ? img->w : img->h;
+    double start = 0;
+    double time = 0;
+    int i = 0, x = 0, y = 0;
+
+    fz_clear_pixmap_with_value(ctx, img, 0x80);
+    fz_scale(&ctm, img->w, img->h);
+    if (rotate) {
+        fz_concat(&ctm, &ctm, fz_rotate(&rotation, 90));
+        ctm.e = w;
+    }
+    start = aptn_now();
+    for(i = 0; i < count; ++i) {
+        for(y = 0; y < h; y += BENCH_TILE) {
+            for(x = 0; x < w; x += BENCH_TILE) {
+                fz_irect scissor;
+                tile->x = x;
+                tile->y = y;
+                fz_pixmap_bbox_no_ctx(tile, &scissor);
+                fz_clear_pixmap_with_value(ctx, tile, 0xff);
+                if (stock) stock_fz_paint_image(tile, &scissor, NULL, img, &ctm, 255);
+                else fz_paint_image(tile, &scissor, NULL, img, &ctm, 255);
+            }
+        }
+    }
+    time = aptn_now() - start;
+    fz_drop_pixmap(ctx, tile);
+    fz_drop_pixmap(ctx, img);
+    return time;
+}
+
+
+int main(int argc, char *argv[]) {
+    aptn_compare_t compare = {
+        .checks = 20000,
+        .check = check,
+        .bench_names = bench_names,
+        .benches = 2,
+        .bench = bench,
+        .count = 5
+    };
+    return aptn_compare(&compare, argc, argv);
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aptn_util.h"
+
+
+/*
+ * Checks CCITT fax decoder against stock mupdf one.
+ *
+ * Every file is raw CCITT data with the same parameters, decoded by both
+ * decoders with BlackIs1 false and true. Outputs must be identical; decode
+ * times are summed over the corpus.
+ */
+
+
+/* stock filt_faxd.c, built with fz_open_faxd renamed */
+fz_stream *stock_fz_open_faxd(fz_stream *chain,
+        int k, int end_of_line, int encoded_byte_align,
+        int columns, int rows, int end_of_block, int black_is_1);
+
+
+static fz_buffer *read_file(fz_context *ctx, const char *filename) {
+    fz_stream *stm = NULL;
+    fz_buffer *buf = NULL;
+    stm = fz_open_file(ctx, filename);
+    fz_try(ctx) {
+        buf = fz_read_all(stm, 0);
+    } fz_always(ctx) {
+        fz_close(stm);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+    return buf;
+}
+
+
+/**
+ * Decode whole buffer.
+ * @return decoded data or NULL on error
+ */
+static fz_buffer *decode(fz_context *ctx, fz_buffer *data, int stock, int k, int columns, int rows, int black_is_1, double *time) {
+    fz_stream *stm = NULL;
+    fz_buffer *out = NULL;
+    double start = aptn_now();
+    stm = fz_open_buffer(ctx, data);
+    if (stock) {
+        stm = stock_fz_open_faxd(stm, k, 0, 0, columns, rows, 1, black_is_1);
+    } else {
+        stm = fz_open_faxd(stm, k, 0, 0, columns, rows, 1, black_is_1);
+    }
+    fz_try(ctx) {
+        out = fz_read_all(stm, 0);
+    } fz_always(ctx) {
+        fz_close(stm);
+    } fz_catch(ctx) {
+        out = NULL;
+    }
+    *time += aptn_now() - start;
+    return out;
+}
+
+
+int main(int argc, char *argv[]) {
+    fz_context *ctx = NULL;
+    fz_buffer *data = NULL;
+    fz_buffer *stock = NULL;
+    fz_buffer *ours = NULL;
+    double stock_time = 0;
+    double our_time = 0;
+    int k = 0;
+    int columns = 0;
+    int rows = 0;
+    int black_is_1 = 0;
+    int mismatches = 0;
+    int i = 0;
+
+    if (argc < 5) {
+        fprintf(stderr, "usage: aptn_faxd K columns rows file...\n");
+        return 1;
+    }
+
+    k = atoi(argv[1]);
+    columns = atoi(argv[2]);
+    rows = atoi(argv[3]);
+
+    ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+    if (ctx == NULL) {
+        fprintf(stderr, "failed to create fitz context\n");
+        return 1;
+    }
+
+    for(i = 4; i < argc; ++i) {
+        fz_try(ctx) {
+            data = read_file(ctx, argv[i]);
+        } fz_catch(ctx) {
+            fprintf(stderr, "failed to read %s\n", argv[i]);
+            continue;
+        }
+        for(black_is_1 = 0; black_is_1 < 2; ++black_is_1) {
+            stock = decode(ctx, data, 1, k, columns, rows, black_is_1, &stock_time);
+            ours = decode(ctx, data, 0, k, columns, rows, black_is_1, &our_time);
+            if ((stock == NULL) != (ours == NULL)
+                    || (stock && (stock->len != ours->len || memcmp(stock->data, ours->data, stock->len)))) {
+                printf("%s: output differs (BlackIs1 %d)\n", argv[i], black_is_1);
+                mismatches++;
+            }
+            fz_drop_buffer(ctx, stock);
+            fz_drop_buffer(ctx, ours);
+        }
+        fz_drop_buffer(ctx, data);
+    }
+
+    printf("%d files, %d mismatches, stock %.3f s, ours %.3f s\n", argc - 4, mismatches, stock_time, our_time);
+
+    fz_free_context(ctx);
+
+    return mismatches != 0;
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
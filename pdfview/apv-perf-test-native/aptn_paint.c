@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aptn_util.h"
+
+
+/*
+ * Checks span painters of draw_paint.c against stock mupdf ones.
+ *
+ * First paints random spans of random widths and alignments with both
+ * versions and compares whole buffers, so that writes past the end of span are
+ * caught too. Then times both versions painting long spans. Only 4 component
+ * pixmaps have SIMD painters, other cases are checked as a sanity check.
+ */
+
+
+/* stock draw_paint.c, built with exported functions renamed */
+void stock_fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color);
+void stock_fz_paint_span(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w, int alpha);
+void stock_fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restrict mp, int n, int w, unsigned char *color);
+void stock_fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk);
+
+
+#define CHECKS_PER_PAINTER 20000
+#define MAX_W 67
+#define PAD 64
+#define BENCH_W 1024
+#define BENCH_H 256
+
+
+enum {
+    SOLID_COLOR,
+    SPAN_WITH_COLOR,
+    SPAN,
+    SPAN_WITH_ALPHA,
+    PIXMAP_WITH_MASK,
+    PAINTERS
+};
+
+static const char *painter_names[PAINTERS] = {
+    "solid_color",
+    "span_with_color",
+    "span",
+    "span_with_alpha",
+    "pixmap_with_mask"
+};
+
+
+/**
+ * Random byte, biased to 0 and 255 so that transparent and opaque shortcuts
+ * are taken.
+ */
+static unsigned char rnd_byte(void) {
+    unsigned int r = aptn_rnd();
+    switch (r & 3) {
+        case 0: return 0;
+        case 1: return 255;
+        default: return r >> 8;
+    }
+}
+
+
+/**
+ * Fill pixels with random data, premultiplied unless garbage is set.
+ */
+static void fill_pixels(unsigned char *p, int n, int w, int garbage) {
+    int i = 0;
+    int k = 0;
+    for(i = 0; i < w; ++i, p += n) {
+        int a = rnd_byte();
+        for(k = 0; k < n - 1; ++k) {
+            p[k] = garbage ? aptn_rnd() : (a ? aptn_rnd() % (a + 1) : 0);
+        }
+        p[n - 1] = a;
+    }
+}
+
+
+/**
+ * Paint span of w pixels into dp with one painter.
+ * Mask and source pixmaps are made around given buffers for pixmap painter.
+ */
+static void paint(fz_context *ctx, int stock, int painter, unsigned char *dp, unsigned char *sp, unsigned char *mp,
+        int n, int w, int h, unsigned char *color, int alpha) {
+    fz_pixmap *dst = NULL;
+    fz_pixmap *src = NULL;
+    fz_pixmap *msk = NULL;
+    int y = 0;
+
+    switch (painter) {
+        case SOLID_COLOR:
+            for(y = 0; y < h; ++y) {
+                if (stock) stock_fz_paint_solid_color(dp + y * w * n, n, w, color);
+                else fz_paint_solid_color(dp + y * w * n, n, w, color);
+            }
+            break;
+        case SPAN_WITH_COLOR:
+            for(y = 0; y < h; ++y) {
+                if (stock) stock_fz_paint_span_with_color(dp + y * w * n, mp + y * w, n, w, color);
+                else fz_paint_span_with_color(dp + y * w * n, mp + y * w, n, w, color);
+            }
+            break;
+        case SPAN:
+        case SPAN_WITH_ALPHA:
+            for(y = 0; y < h; ++y) {
+                if (stock) stock_fz_paint_span(dp + y * w * n, sp + y * w * n, n, w, alpha);
+                else fz_paint_span(dp + y * w * n, sp + y * w * n, n, w, alpha);
+            }
+            break;
+        case PIXMAP_WITH_MASK:
+            dst = fz_new_pixmap_with_data(ctx, n == 4 ? fz_device_rgb(ctx) : fz_device_gray(ctx), w, h, dp);
+            src = fz_new_pixmap_with_data(ctx, n == 4 ? fz_device_rgb(ctx) : fz_device_gray(ctx), w, h, sp);
+            msk = fz_new_pixmap_with_data(ctx, NULL, w, h, mp);
+            if (stock) stock_fz_paint_pixmap_with_mask(dst, src, msk);
+            else fz_paint_pixmap_with_mask(dst, src, msk);
+            fz_drop_pixmap(ctx, dst);
+            fz_drop_pixmap(ctx, src);
+            fz_drop_pixmap(ctx, msk);
+            break;
+    }
+}
+
+
+/**
+ * Paint random span with both versions, CHECKS_PER_PAINTER spans with each
+ * painter, every fourth of them 2 component.
+ * @return 1 if outputs are the same
+ */
+static int check(fz_context *ctx, int i) {
+    int painter = i / CHECKS_PER_PAINTER;
+    int n = i % 4 ? 4 : 2;
+    unsigned char dst_buf[PAD + MAX_W * 4 + PAD];
+    unsigned char stock_buf[sizeof(dst_buf)];
+    unsigned char src_buf[PAD + MAX_W * 4 + PAD];
+    unsigned char mask_buf[PAD + MAX_W + PAD];
+    unsigned char color[4];
+    unsigned char *dp = dst_buf + PAD + aptn_rnd() % 4;
+    unsigned char *sp = src_buf + PAD + aptn_rnd() % 4;
+    unsigned char *mp = mask_buf + PAD + aptn_rnd() % 4;
+    int w = aptn_rnd() % (MAX_W + 1);
+    int alpha = painter == SPAN ? 255 : 1 + aptn_rnd() % 254;
+    unsigned int k = 0;
+
+    for(k = 0; k < sizeof(dst_buf); ++k) dst_buf[k] = aptn_rnd();
+    fill_pixels(dp, n, w, 0);
+    memcpy(stock_buf, dst_buf, sizeof(dst_buf));
+    fill_pixels(sp, n, w, aptn_rnd() % 4 == 0);
+    for(k = 0; k < (unsigned int)w; ++k) mp[k] = rnd_byte();
+    for(k = 0; k < 4; ++k) color[k] = aptn_rnd() % 2 ? aptn_rnd() : rnd_byte();
+
+    paint(ctx, 0, painter, dp, sp, mp, n, w, 1, color, alpha);
+    paint(ctx, 1, painter, stock_buf + (dp - dst_buf), sp, mp, n, w, 1, color, alpha);
+
+    if (memcmp(dst_buf, stock_buf, sizeof(dst_buf))) {
+        printf("%s n %d w %d: output differs\n", painter_names[painter], n, w);
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Time painter on BENCH_H spans of BENCH_W pixels, repeated count times.
+ */
+static double bench(fz_context *ctx, int painter, int stock, int count) {
+    unsigned char *dp = malloc(BENCH_W * BENCH_H * 4);
+    unsigned char *sp = malloc(BENCH_W * BENCH_H * 4);
+    unsigned char *mp = malloc(BENCH_W * BENCH_H);
+    unsigned char color[4] = { 200, 100, 50, painter == SOLID_COLOR ? 128 : 255 };
+    double start = 0;
+    double time = 0;
+    int i = 0;
+
+    fill_pixels(dp, 4, BENCH_W * BENCH_H, 0);
+    fill_pixels(sp, 4, BENCH_W * BENCH_H, 0);
+    for(i = 0; i < BENCH_W * BENCH_H; ++i) mp[i] = rnd_byte();
+
+    start = aptn_now();
+    for(i = 0; i < count; ++i) {
+        paint(ctx, stock, painter, dp, sp, mp, 4, BENCH_W, BENCH_H, color, painter == SPAN_WITH_ALPHA ? 128 : 255);
+    }
+    time = aptn_now() - start;
+
+    free(dp);
+    free(sp);
+    free(mp);
+    return time;
+}
+
+
+int main(int argc, char *argv[]) {
+    aptn_compare_t compare = {
+        .checks = CHECKS_PER_PAINTER * PAINTERS,
+        .check = check,
+        .bench_names = painter_names,
+        .benches = PAINTERS,
+        .bench = bench,
+        .count = 50
+    };
+    return aptn_compare(&compare, argc, argv);
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aptn_util.h"
+
+
+/*
+ * Checks path rasterizer of draw_edge.c and draw_path.c against stock mupdf
+ * one.
+ *
+ * First fills and strokes random paths with random transforms, clips and
+ * anti-aliasing levels with both versions and compares whole pixmaps. Both
+ * versions reuse one gel for all paths, as draw device does. Then times both
+ * versions on a page sized path with many curves, drawn whole and as tiles.
+ */
+
+
+/* stock draw_edge.c and draw_path.c, built with exported functions renamed */
+fz_gel *stock_fz_new_gel(fz_context *ctx);
+void stock_fz_reset_gel(fz_gel *gel, const fz_irect *clip);
+void stock_fz_sort_gel(fz_gel *gel);
+fz_irect *stock_fz_bound_gel(const fz_gel *gel, fz_irect *bbox);
+void stock_fz_free_gel(fz_gel *gel);
+void stock_fz_scan_convert(fz_gel *gel, int eofill, const fz_irect *clip, fz_pixmap *pix, unsigned char *colorbv);
+void stock_fz_flatten_fill_path(fz_gel *gel, fz_path *path, const fz_matrix *ctm, float flatness);
+void stock_fz_flatten_stroke_path(fz_gel *gel, fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, float flatness, float linewidth);
+void stock_fz_flatten_dash_path(fz_gel *gel, fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, float flatness, float linewidth);
+
+
+#define CHECK_W 160
+#define CHECK_H 120
+#define BENCH_W 1224
+#define BENCH_H 1584
+#define BENCH_TILE 256
+
+
+static const int aa_levels[] = { 0, 1, 2, 4, 6, 8 };
+
+
+static const char *bench_names[] = { "page", "tiles" };
+
+/* shared by all checks, as draw device reuses one gel */
+static fz_gel *check_gel = NULL;
+static fz_gel *check_stock_gel = NULL;
+static fz_pixmap *check_pix = NULL;
+static fz_pixmap *check_stock_pix = NULL;
+
+
+/**
+ * Random path of a few subpaths of lines and curves, some of them reaching
+ * out of w x h area.
+ */
+static fz_path *random_path(fz_context *ctx, float w, float h) {
+    fz_path *path = fz_new_path(ctx);
+    int subpaths = 1 + aptn_rnd() % 4;
+    int i = 0;
+    int k = 0;
+
+    for(i = 0; i < subpaths; ++i) {
+        int segments = 1 + aptn_rnd() % 12;
+        fz_moveto(ctx, path, aptn_rnd_float(-w / 2, w * 1.5f), aptn_rnd_float(-h / 2, h * 1.5f));
+        for(k = 0; k < segments; ++k) {
+            if (aptn_rnd() % 2) {
+                fz_lineto(ctx, path, aptn_rnd_float(-w / 2, w * 1.5f), aptn_rnd_float(-h / 2, h * 1.5f));
+            } else {
+                fz_curveto(ctx, path,
+                        aptn_rnd_float(-w / 2, w * 1.5f), aptn_rnd_float(-h / 2, h * 1.5f),
+                        aptn_rnd_float(-w / 2, w * 1.5f), aptn_rnd_float(-h / 2, h * 1.5f),
+                        aptn_rnd_float(-w / 2, w * 1.5f), aptn_rnd_float(-h / 2, h * 1.5f));
+            }
+        }
+        if (aptn_rnd() % 2) fz_closepath(ctx, path);
+    }
+    return path;
+}
+
+
+/**
+ * Path of many small closed curved shapes in rows, like a page of glyph
+ * outlines in user space of w x h page.
+ */
+static fz_path *text_like_path(fz_context *ctx, float w, float h) {
+    fz_path *path = fz_new_path(ctx);
+    float x = 0;
+    float y = 0;
+
+    for(y = 20; y < h - 20; y += 14) {
+        for(x = 20; x < w - 20; x += 7) {
+            fz_moveto(ctx, path, x, y);
+            fz_curveto(ctx, path, x, y + 6, x + 5, y + 6, x + 5, y + 3);
+            fz_curveto(ctx, path, x + 5, y, x + 2, y - 3, x + 1, y + 1);
+            fz_lineto(ctx, path, x + 3, y + 2);
+            fz_curveto(ctx, path, x + 3, y + 4, x + 1, y + 4, x + 1, y + 2);
+            fz_closepath(ctx, path);
+        }
+    }
+    return path;
+}
+
+
+/**
+ * Fill or stroke path into pix with one version of rasterizer, the same way
+ * draw device does.
+ */
+static void draw(fz_context *ctx, int stock, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, int even_odd,
+        const fz_matrix *ctm, const fz_irect *scissor, fz_pixmap *pix, unsigned char *color) {
+    float expansion = fz_matrix_expansion(ctm);
+    float flatness = 0.3f / expansion;
+    float linewidth = stroke ? stroke->linewidth : 0;
+    fz_irect bbox;
+
+    if (stroke && linewidth * expansion < 0.1f)
+        linewidth = 1 / expansion;
+
+    if (stock) {
+        stock_fz_reset_gel(gel, scissor);
+        if (stroke == NULL) stock_fz_flatten_fill_path(gel, path, ctm, flatness);
+        else if (stroke->dash_len > 0) stock_fz_flatten_dash_path(gel, path, stroke, ctm, flatness, linewidth);
+        else stock_fz_flatten_stroke_path(gel, path, stroke, ctm, flatness, linewidth);
+        stock_fz_sort_gel(gel);
+        fz_intersect_irect(stock_fz_bound_gel(gel, &bbox), scissor);
+        if (!fz_is_empty_irect(&bbox))
+            stock_fz_scan_convert(gel, even_odd, &bbox, pix, color);
+    } else {
+        fz_reset_gel(gel, scissor);
+        if (stroke == NULL) fz_flatten_fill_path(gel, path, ctm, flatness);
+        else if (stroke->dash_len > 0) fz_flatten_dash_path(gel, path, stroke, ctm, flatness, linewidth);
+        else fz_flatten_stroke_path(gel, path, stroke, ctm, flatness, linewidth);
+        fz_sort_gel(gel);
+        fz_intersect_irect(fz_bound_gel(gel, &bbox), scissor);
+        if (!fz_is_empty_irect(&bbox))
+            fz_scan_convert(gel, even_odd, &bbox, pix, color);
+    }
+}
+
+
+static void start_checks(fz_context *ctx) {
+    check_gel = fz_new_gel(ctx);
+    check_stock_gel = stock_fz_new_gel(ctx);
+    check_pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), CHECK_W, CHECK_H);
+    check_stock_pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), CHECK_W, CHECK_H);
+}
+
+
+static void end_checks(fz_context *ctx) {
+    fz_drop_pixmap(ctx, check_pix);
+    fz_drop_pixmap(ctx, check_stock_pix);
+    fz_free_gel(check_gel);
+    stock_fz_free_gel(check_stock_gel);
+}
+
+
+/**
+ * Draw random path with both versions.
+ * @return 1 if outputs are the same
+ */
+static int check(fz_context *ctx, int number) {
+    fz_gel *gel = check_gel;
+    fz_gel *stock_gel = check_stock_gel;
+    fz_pixmap *pix = check_pix;
+    fz_pixmap *stock_pix = check_stock_pix;
+    fz_path *path = random_path(ctx, CHECK_W, CHECK_H);
+    fz_stroke_state *stroke = NULL;
+    int aa_level = aa_levels[aptn_rnd() % (sizeof(aa_levels) / sizeof(aa_levels[0]))];
+    int even_odd = aptn_rnd() % 2;
+    unsigned char color[4];
+    fz_matrix ctm;
+    fz_irect scissor;
+    int i = 0;
+    int same = 0;
+
+    fz_scale(&ctm, aptn_rnd_float(0.2f, 3), aptn_rnd_float(0.2f, 3));
+    if (aptn_rnd() % 3 == 0) fz_pre_rotate(&ctm, aptn_rnd_float(0, 360));
+    fz_pre_translate(&ctm, aptn_rnd_float(-CHECK_W / 2, CHECK_W / 2), aptn_rnd_float(-CHECK_H / 2, CHECK_H / 2));
+
+    if (aptn_rnd() % 3 == 0) {
+        scissor.x0 = 0;
+        scissor.y0 = 0;
+        scissor.x1 = CHECK_W;
+        scissor.y1 = CHECK_H;
+    } else {
+        scissor.x0 = aptn_rnd() % CHECK_W;
+        scissor.y0 = aptn_rnd() % CHECK_H;
+        scissor.x1 = scissor.x0 + 1 + aptn_rnd() % (CHECK_W - scissor.x0);
+        scissor.y1 = scissor.y0 + 1 + aptn_rnd() % (CHECK_H - scissor.y0);
+    }
+
+    if (aptn_rnd() % 3 == 0) {
+        stroke = fz_new_stroke_state(ctx);
+        stroke->linewidth = aptn_rnd() % 4 == 0 ? 0 : aptn_rnd_float(0.1f, 8);
+        stroke->start_cap = stroke->dash_cap = stroke->end_cap = aptn_rnd() % 4;
+        stroke->linejoin = aptn_rnd() % 4;
+        stroke->miterlimit = aptn_rnd_float(1, 10);
+        if (aptn_rnd() % 3 == 0) {
+            stroke->dash_len = 2;
+            stroke->dash_list[0] = aptn_rnd_float(0.5f, 10);
+            stroke->dash_list[1] = aptn_rnd_float(0.5f, 10);
+            stroke->dash_phase = aptn_rnd_float(0, 5);
+        }
+        even_odd = 0;
+    }
+
+    for(i = 0; i < 3; ++i) color[i] = aptn_rnd();
+    color[3] = aptn_rnd() % 2 ? 255 : aptn_rnd();
+
+    fz_set_aa_level(ctx, aa_level);
+    fz_clear_pixmap(ctx, pix);
+    fz_clear_pixmap(ctx, stock_pix);
+    draw(ctx, 0, gel, path, stroke, even_odd, &ctm, &scissor, pix, color);
+    draw(ctx, 1, stock_gel, path, stroke, even_odd, &ctm, &scissor, stock_pix, color);
+
+    same = !memcmp(pix->samples, stock_pix->samples, pix->w * pix->h * pix->n);
+    if (!same) {
+        printf("%s aa %d even_odd %d: output differs\n", stroke ? "stroke" : "fill", aa_level, even_odd);
+    }
+
+    if (stroke) fz_drop_stroke_state(ctx, stroke);
+    fz_free_path(ctx, path);
+    return same;
+}
+
+
+/**
+ * Time drawing page sized text like path count times, as whole page or as
+ * BENCH_TILE tiles.
+ */
+static double bench(fz_context *ctx, int tiled, int stock, int count) {
+    fz_path *path = text_like_path(ctx, BENCH_W, BENCH_H);
+    fz_gel *gel = stock ? stock_fz_new_gel(ctx) : fz_new_gel(ctx);
+    fz_pixmap *pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), BENCH_W, BENCH_H);
+    unsigned char color[4] = { 0, 0, 0, 255 };
+    fz_matrix ctm;
+    fz_irect scissor;
+    double start = 0;
+    double time = 0;
+    int i = 0;
+    int x = 0;
+    int y = 0;
+
+    fz_scale(&ctm, 1, 1);
+    fz_set_aa_level(ctx, 8);
+    fz_clear_pixmap(ctx, pix);
+
+    start = aptn_now();
+    for(i = 0; i < count; ++i) {
+        if (!tiled) {
+            scissor.x0 = 0;
+            scissor.y0 = 0;
+            scissor.x1 = BENCH_W;
+            scissor.y1 = BENCH_H;
+            draw(ctx, stock, gel, path, NULL, 0, &ctm, &scissor, pix, color);
+            continue;
+        }
+        for(y = 0; y < BENCH_H; y += BENCH_TILE) {
+            for(x = 0; x < BENCH_W; x += BENCH_TILE) {
+                scissor.x0 = x;
+                scissor.y0 = y;
+                scissor.x1 = fz_mini(x + BENCH_TILE, BENCH_W);
+                scissor.y1 = fz_mini(y + BENCH_TILE, BENCH_H);
+                draw(ctx, stock, gel, path, NULL, 0, &ctm, &scissor, pix, color);
+            }
+        }
+    }
+    time = aptn_now() - start;
+
+    fz_drop_pixmap(ctx, pix);
+    if (stock) stock_fz_free_gel(gel);
+    else fz_free_gel(gel);
+    fz_free_path(ctx, path);
+    return time;
+}
+
+
+int main(int argc, char *argv[]) {
+    aptn_compare_t compare = {
+        .checks = 20000,
+        .start_checks = start_checks,
+        .check = check,
+        .end_checks = end_checks,
+        .bench_names = bench_names,
+        .benches = 2,
+        .bench = bench,
+        .count = 5
+    };
+    return aptn_compare(&compare, argc, argv);
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "aptn_util.h"
+
+
+/*
+ * Checks image scaler of draw_scale.c against stock mupdf one.
+ *
+ * First scales random 1, 2 and 4 component pixmaps by random factors, flips,
+ * offsets and clips with both versions and compares whole pixmaps; they must
+ * be equal. Integer downscales that apv does as box averages are compared
+ * with a plain box average instead, and the largest difference to stock
+ * filter is printed. Then times both versions on scan sized images.
+ */
+
+
+/* stock draw_scale.c, built with exported functions renamed */
+fz_scale_cache *stock_fz_new_scale_cache(fz_context *ctx);
+void stock_fz_free_scale_cache(fz_context *ctx, fz_scale_cache *cache);
+fz_pixmap *stock_fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y);
+
+
+#define BOX_MIN_FACTOR 4
+#define BENCH_W 2480
+#define BENCH_H 3508
+
+
+static const struct {
+    int n;
+    float scale;
+} benches[] = {
+    { 4, 0.4f },
+    { 4, 0.25f },
+    { 4, 1.5f },
+    { 2, 0.4f },
+    { 1, 0.4f },
+};
+
+static const char *bench_names[] = {
+    "rgb 0.4",
+    "rgb 1/4",
+    "rgb 1.5",
+    "gray 0.4",
+    "mask 0.4",
+};
+
+/* our and stock caches for x and y, shared by all checks */
+static fz_scale_cache *caches[4];
+
+/* largest difference of box averages from stock filter */
+static int box_diff = 0;
+
+
+static fz_pixmap *new_random_pixmap(fz_context *ctx, int n, int w, int h) {
+    fz_colorspace *cs = n == 1 ? NULL : n == 2 ? fz_device_gray(ctx) : fz_device_rgb(ctx);
+    fz_pixmap *pix = fz_new_pixmap(ctx, cs, w, h);
+    int i = 0;
+    /* mostly smooth with some noise, like real images */
+    for(i = 0; i < w * h * n; ++i) {
+        pix->samples[i] = (aptn_rnd() % 4 == 0) ? aptn_rnd() : (i / n % w + i / n / w) * 7 + i % n * 50;
+    }
+    return pix;
+}
+
+
+static int same_pixmaps(fz_pixmap *a, fz_pixmap *b) {
+    if (a == NULL || b == NULL) return a == b;
+    return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h && a->n == b->n
+        && memcmp(a->samples, b->samples, a->w * a->h * a->n) == 0;
+}
+
+
+/**
+ * Compares box scaled pix against plain box average of kx by ky source pixels.
+ * left and top are where unclipped image is, right edge and bottom if flipped.
+ */
+static int check_box(fz_pixmap *src, fz_pixmap *pix, int kx, int ky, int left, int top, int flip_x, int flip_y) {
+    int dw = src->w / kx;
+    int dh = src->h / ky;
+    int n = src->n;
+    int r = 0, c = 0, k = 0;
+    if (flip_x) left -= dw;
+    if (flip_y) top -= dh;
+    for(r = 0; r < pix->h; ++r) {
+        for(c = 0; c < pix->w; ++c) {
+            int p = pix->y + r - top;
+            int j = pix->x + c - left;
+            if (flip_x) j = dw - 1 - j;
+            for(k = 0; k < n; ++k) {
+                int sum = 0;
+                int t = 0, u = 0;
+                for(t = 0; t < ky; ++t) {
+                    int m = p * ky + t;
+                    unsigned char *s = &src->samples[(flip_y ? src->h - 1 - m : m) * src->w * n];
+                    for(u = 0; u < kx; ++u) sum += s[(j * kx + u) * n + k];
+                }
+                if (pix->samples[(r * pix->w + c) * n + k] != (sum + kx * ky / 2) / (kx * ky)) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static int max_diff(fz_pixmap *a, fz_pixmap *b) {
+    int diff = 0;
+    int i = 0;
+    if (a == NULL || b == NULL || a->w != b->w || a->h != b->h || a->x != b->x || a->y != b->y) return 256;
+    for(i = 0; i < a->w * a->h * a->n; ++i) {
+        int d = abs(a->samples[i] - b->samples[i]);
+        if (d > diff) diff = d;
+    }
+    return diff;
+}
+
+
+static void start_checks(fz_context *ctx) {
+    caches[0] = fz_new_scale_cache(ctx);
+    caches[1] = fz_new_scale_cache(ctx);
+    caches[2] = stock_fz_new_scale_cache(ctx);
+    caches[3] = stock_fz_new_scale_cache(ctx);
+}
+
+
+static void end_checks(fz_context *ctx) {
+    printf("box averages differ from stock by at most %d\n", box_diff);
+    fz_free_scale_cache(ctx, caches[0]);
+    fz_free_scale_cache(ctx, caches[1]);
+    stock_fz_free_scale_cache(ctx, caches[2]);
+    stock_fz_free_scale_cache(ctx, caches[3]);
+}
+
+
+/**
+ * Scales random pixmap with both versions, returns 0 on mismatch.
+ */
+static int check(fz_context *ctx, int number) {
+    static const int ns[] = { 1, 2, 4 };
+    int n = ns[aptn_rnd() % 3];
+    int box = aptn_rnd() % 4 == 0;
+    int kx = 0, ky = 0;
+    int sw = 0, sh = 0;
+    float x = 0, y = 0, w = 0, h = 0;
+    int flip_x = aptn_rnd() % 4 == 0;
+    int flip_y = aptn_rnd() % 4 == 0;
+    fz_irect clip;
+    fz_irect *clipp = NULL;
+    fz_pixmap *src = NULL;
+    fz_pixmap *ours = NULL;
+    fz_pixmap *stock = NULL;
+    int use_cache = aptn_rnd() % 2;
+    int ok = 0;
+
+    if (box) {
+        kx = BOX_MIN_FACTOR + aptn_rnd() % 12;
+        ky = BOX_MIN_FACTOR + aptn_rnd() % 12;
+        sw = kx * (1 + aptn_rnd() % 40);
+        sh = ky * (1 + aptn_rnd() % 40);
+        w = sw / kx;
+        h = sh / ky;
+        x = (int)(aptn_rnd() % 200) - 100;
+        y = (int)(aptn_rnd() % 200) - 100;
+    } else {
+        sw = 1 + aptn_rnd() % 300;
+        sh = 1 + aptn_rnd() % 300;
+        /* down to 1/40, up to 3 times */
+        w = sw * aptn_rnd_float(0.025f, 3);
+        h = sh * aptn_rnd_float(0.025f, 3);
+        if (w > 600) w = 600;
+        if (h > 600) h = 600;
+        x = aptn_rnd_float(-100, 100);
+        y = aptn_rnd_float(-100, 100);
+        if (aptn_rnd() % 4 == 0) {
+            /* integer sizes and positions, but not a box case */
+            w = floorf(w) + 1;
+            h = floorf(h) + 1;
+            x = floorf(x);
+            y = floorf(y);
+        }
+    }
+    if (flip_x) w = -w;
+    if (flip_y) h = -h;
+    if (aptn_rnd() % 2) {
+        clip.x0 = x - 100 + aptn_rnd() % 200;
+        clip.y0 = y - 100 + aptn_rnd() % 200;
+        clip.x1 = clip.x0 + aptn_rnd() % 300;
+        clip.y1 = clip.y0 + aptn_rnd() % 300;
+        clipp = &clip;
+    }
+
+    src = new_random_pixmap(ctx, n, sw, sh);
+    ours = fz_scale_pixmap_cached(ctx, src, x, y, w, h, clipp, use_cache ? caches[0] : NULL, use_cache ? caches[1] : NULL);
+    stock = stock_fz_scale_pixmap_cached(ctx, src, x, y, w, h, clipp, use_cache ? caches[2] : NULL, use_cache ? caches[3] : NULL);
+    if (box) {
+        ok = ours != NULL && stock != NULL && check_box(src, ours, kx, ky, x, y, flip_x, flip_y);
+        if (ours == NULL && stock == NULL) ok = 1;
+        if (ok && ours != NULL) {
+            int d = max_diff(ours, stock);
+            if (d > box_diff) box_diff = d;
+        }
+    } else {
+        ok = same_pixmaps(ours, stock);
+    }
+    if (!ok) {
+        printf("mismatch: n %d, %d x %d to %g x %g at %g, %g\n", n, sw, sh, w, h, x, y);
+    }
+    if (ours) fz_drop_pixmap(ctx, ours);
+    if (stock) fz_drop_pixmap(ctx, stock);
+    fz_drop_pixmap(ctx, src);
+    return ok;
+}
+
+
+/**
+ * Times count scales of scan sized page to bench-th scale, a bit smaller page
+ * when scaling up, returns seconds.
+ */
+static double bench(fz_context *ctx, int bench, int stock, int count) {
+    float k = benches[bench].scale > 1 ? 0.5f : 1;
+    fz_pixmap *src = new_random_pixmap(ctx, benches[bench].n, BENCH_W * k, BENCH_H * k);
+    float w = src->w * benches[bench].scale;
+    float h = src->h * benches[bench].scale;
+    double start = aptn_now();
+    double time = 0;
+    int i = 0;
+    for(i = 0; i < count; ++i) {
+        fz_pixmap *pix = NULL;
+        if (stock) pix = stock_fz_scale_pixmap_cached(ctx, src, 0, 0, w, h, NULL, NULL, NULL);
+        else pix = fz_scale_pixmap_cached(ctx, src, 0, 0, w, h, NULL, NULL, NULL);
+        fz_drop_pixmap(ctx, pix);
+    }
+    time = aptn_now() - start;
+    fz_drop_pixmap(ctx, src);
+    return time;
+}
+
+
+int main(int argc, char *argv[]) {
+    aptn_compare_t compare = {
+        .checks = 5000,
+        .start_checks = start_checks,
+        .check = check,
+        .end_checks = end_checks,
+        .bench_names = bench_names,
+        .benches = sizeof(benches) / sizeof(benches[0]),
+        .bench = bench,
+        .count = 3
+    };
+    return aptn_compare(&compare, argc, argv);
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
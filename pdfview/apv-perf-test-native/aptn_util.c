@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aptn_util.h"
+
+
+#define CHECK_SEED 12345
+#define BENCH_SEED 54321
+
+
+unsigned int aptn_seed = CHECK_SEED;
+
+
+/**
+ * Xorshift, so that random cases are the same on every host.
+ */
+unsigned int aptn_rnd(void) {
+    aptn_seed ^= aptn_seed << 13;
+    aptn_seed ^= aptn_seed >> 17;
+    aptn_seed ^= aptn_seed << 5;
+    return aptn_seed;
+}
+
+
+float aptn_rnd_float(float from, float to) {
+    return from + (to - from) * (aptn_rnd() % 100000) / 100000.0f;
+}
+
+
+double aptn_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int aptn_compare(const aptn_compare_t *compare, int argc, char *argv[]) {
+    fz_context *ctx = NULL;
+    int count = compare->count;
+    int mismatches = 0;
+    int width = 0;
+    int i = 0;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+
+    ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+    if (ctx == NULL) {
+        fprintf(stderr, "failed to create fitz context\n");
+        return 1;
+    }
+
+    aptn_seed = CHECK_SEED;
+    if (compare->start_checks) compare->start_checks(ctx);
+    for(i = 0; i < compare->checks; ++i) {
+        if (!compare->check(ctx, i)) mismatches++;
+    }
+    printf("%d mismatches\n", mismatches);
+    if (compare->end_checks) compare->end_checks(ctx);
+
+    for(i = 0; i < compare->benches; ++i) {
+        int len = strlen(compare->bench_names[i]);
+        if (len > width) width = len;
+    }
+    for(i = 0; i < compare->benches; ++i) {
+        double stock_time = 0;
+        double our_time = 0;
+        /* both versions get the same input */
+        aptn_seed = BENCH_SEED;
+        stock_time = compare->bench(ctx, i, 1, count);
+        aptn_seed = BENCH_SEED;
+        our_time = compare->bench(ctx, i, 0, count);
+        printf("%-*s stock %.3f s, ours %.3f s\n", width, compare->bench_names[i], stock_time, our_time);
+    }
+
+    fz_free_context(ctx);
+
+    return mismatches != 0;
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,56 @@
+#ifndef APTN_UTIL_H
+#define APTN_UTIL_H
+
+#include "fitz-internal.h"
+
+
+/*
+ * Helpers shared by aptn_* checks of apv changes to mupdf.
+ *
+ * Each check links apv version of some mupdf code together with stock
+ * version built with exported functions renamed to stock_*, compares their
+ * outputs on random input and then times both of them.
+ */
+
+
+/**
+ * Compare-then-benchmark description, see aptn_compare.
+ */
+typedef struct {
+    /* number of random cases compared */
+    int checks;
+    /* called once before checks, may be NULL */
+    void (*start_checks)(fz_context *ctx);
+    /* compare i-th random case, return 1 if both versions give the same output */
+    int (*check)(fz_context *ctx, int i);
+    /* called once after checks, may be NULL */
+    void (*end_checks)(fz_context *ctx);
+    /* benchmark names, one for each benchmark */
+    const char **bench_names;
+    int benches;
+    /* run bench-th benchmark count times with stock or apv version, return seconds */
+    double (*bench)(fz_context *ctx, int bench, int stock, int count);
+    /* default count, can be overridden by first command line argument */
+    int count;
+} aptn_compare_t;
+
+
+/* state of aptn_rnd, reset to the same value before each benchmark */
+extern unsigned int aptn_seed;
+
+unsigned int aptn_rnd(void);
+float aptn_rnd_float(float from, float to);
+double aptn_now(void);
+
+/**
+ * Run checks, print number of mismatches, then run each benchmark with stock
+ * and apv version and print both times.
+ * @return process exit code, 0 if there were no mismatches
+ */
+int aptn_compare(const aptn_compare_t *compare, int argc, char *argv[]);
+
+
+#endif
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,345 @@
+#include "fitz-internal.h"
+
+/*
+
+SIMD versions of the 4 component painters of draw_paint.c.
+
+Each function paints the longest prefix of the span that is a whole number
+of vectors and returns its length in pixels; the caller paints the rest with
+the scalar code. The results are bit for bit the same as the scalar code:
+all intermediate values of FZ_EXPAND, FZ_COMBINE and FZ_BLEND fit in 16 bits
+(FZ_BLEND is computed as (S*A + D*(256-A))>>8, which never exceeds 255*256),
+and results are narrowed by dropping the high byte, just like the store to a
+byte does.
+
+SSE2 is used on x86, where every Android device has it. NEON code hasn't
+been compared with the scalar code on ARM yet, so it's built only with
+ndk-build APV_NEON=1 (see draw/Android.mk); then it's used on armeabi-v7a
+only if the CPU has it (this file is built with -mfpu=neon there), on arm64
+always. On other CPUs the functions paint nothing.
+
+*/
+
+#if defined(__SSE2__)
+#define APV_PAINT_SSE2
+#include <emmintrin.h>
+#elif defined(APV_NEON) && (defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__))
+#define APV_PAINT_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <cpu-features.h>
+#endif
+#endif
+
+typedef unsigned char byte;
+
+#ifdef APV_PAINT_SSE2
+
+/* 16 bit lanes of 2 pixels: broadcast each pixel's alpha to its 4 lanes */
+#define SPLAT_ALPHA(X) _mm_shufflehi_epi16(_mm_shufflelo_epi16((X), 0xff), 0xff)
+#define EXPAND16(X) _mm_add_epi16((X), _mm_srli_epi16((X), 7))
+#define COMBINE16(A,B) _mm_srli_epi16(_mm_mullo_epi16((A), (B)), 8)
+
+/* (a * m + b * (256 - m)) >> 8, that is FZ_BLEND(a, b, m) */
+static inline __m128i
+blend16(__m128i a, __m128i b, __m128i m)
+{
+	__m128i im = _mm_sub_epi16(_mm_set1_epi16(256), m);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, m), _mm_mullo_epi16(b, im)), 8);
+}
+
+/* 4 mask bytes to 16 bit lanes, each repeated for 4 components of 2 pixels */
+static inline void
+spread_mask(__m128i m, __m128i *lo, __m128i *hi)
+{
+	m = _mm_unpacklo_epi16(m, m);
+	*lo = _mm_unpacklo_epi32(m, m);
+	*hi = _mm_unpackhi_epi32(m, m);
+}
+
+static inline unsigned int
+load_4_bytes(const byte *p)
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+#endif
+
+#ifdef APV_PAINT_NEON
+
+#define EXPAND16(X) vsraq_n_u16((X), (X), 7)
+#define COMBINE16(A,B) vshrq_n_u16(vmulq_u16((A), (B)), 8)
+
+/* (a * m + b * im) >> 8 where im is 256 - m, that is FZ_BLEND(a, b, m) */
+static inline uint16x8_t
+blend16(uint16x8_t a, uint16x8_t b, uint16x8_t m, uint16x8_t im)
+{
+	return vshrq_n_u16(vmlaq_u16(vmulq_u16(a, m), b, im), 8);
+}
+
+static inline int
+have_neon(void)
+{
+#if defined(__aarch64__)
+	return 1;
+#else
+	/* cached by cpufeatures after first call */
+	return (android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON) != 0;
+#endif
+}
+
+static inline int
+zero_8_bytes(const byte *p)
+{
+	unsigned int v[2];
+	memcpy(v, p, 8);
+	return (v[0] | v[1]) == 0;
+}
+
+#endif
+
+int
+fz_paint_solid_color_4_simd(byte * restrict dp, int w, const byte *color)
+{
+	int sa = FZ_EXPAND(color[3]);
+	int i = 0;
+#if defined(APV_PAINT_SSE2)
+	if (sa == 256)
+	{
+		unsigned int px = color[0] | (color[1] << 8) | (color[2] << 16) | (255u << 24);
+		__m128i c = _mm_set1_epi32(px);
+		for (; i + 4 <= w; i += 4, dp += 16)
+			_mm_storeu_si128((__m128i *)dp, c);
+	}
+	else
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+		__m128i ma = _mm_set1_epi16(sa);
+		for (; i + 4 <= w; i += 4, dp += 16)
+		{
+			__m128i d = _mm_loadu_si128((const __m128i *)dp);
+			__m128i lo = blend16(c, _mm_unpacklo_epi8(d, zero), ma);
+			__m128i hi = blend16(c, _mm_unpackhi_epi8(d, zero), ma);
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(APV_PAINT_NEON)
+	if (!have_neon())
+		return 0;
+	if (sa == 256)
+	{
+		uint8x8x4_t c;
+		c.val[0] = vdup_n_u8(color[0]);
+		c.val[1] = vdup_n_u8(color[1]);
+		c.val[2] = vdup_n_u8(color[2]);
+		c.val[3] = vdup_n_u8(255);
+		for (; i + 8 <= w; i += 8, dp += 32)
+			vst4_u8(dp, c);
+	}
+	else
+	{
+		uint16x8_t ma = vdupq_n_u16(sa);
+		uint16x8_t ima = vdupq_n_u16(256 - sa);
+		uint16x8_t c0 = vdupq_n_u16(color[0]);
+		uint16x8_t c1 = vdupq_n_u16(color[1]);
+		uint16x8_t c2 = vdupq_n_u16(color[2]);
+		uint16x8_t c3 = vdupq_n_u16(255);
+		for (; i + 8 <= w; i += 8, dp += 32)
+		{
+			uint8x8x4_t d = vld4_u8(dp);
+			d.val[0] = vmovn_u16(blend16(c0, vmovl_u8(d.val[0]), ma, ima));
+			d.val[1] = vmovn_u16(blend16(c1, vmovl_u8(d.val[1]), ma, ima));
+			d.val[2] = vmovn_u16(blend16(c2, vmovl_u8(d.val[2]), ma, ima));
+			d.val[3] = vmovn_u16(blend16(c3, vmovl_u8(d.val[3]), ma, ima));
+			vst4_u8(dp, d);
+		}
+	}
+#endif
+	return i;
+}
+
+int
+fz_paint_span_with_color_4_simd(byte * restrict dp, const byte * restrict mp, int w, const byte *color)
+{
+	int sa = FZ_EXPAND(color[3]);
+	int i = 0;
+#if defined(APV_PAINT_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	__m128i vsa = _mm_set1_epi16(sa);
+	for (; i + 4 <= w; i += 4, dp += 16, mp += 4)
+	{
+		unsigned int m4 = load_4_bytes(mp);
+		__m128i ma, malo, mahi, d, lo, hi;
+		/* outside of shape, common in glyphs and thin strokes */
+		if (m4 == 0)
+			continue;
+		ma = EXPAND16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m4), zero));
+		/* FZ_COMBINE of 256 and 256 would not fit in 16 bits */
+		if (sa != 256)
+			ma = COMBINE16(ma, vsa);
+		spread_mask(ma, &malo, &mahi);
+		d = _mm_loadu_si128((const __m128i *)dp);
+		lo = blend16(c, _mm_unpacklo_epi8(d, zero), malo);
+		hi = blend16(c, _mm_unpackhi_epi8(d, zero), mahi);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+#elif defined(APV_PAINT_NEON)
+	uint16x8_t vsa = vdupq_n_u16(sa);
+	uint16x8_t c256 = vdupq_n_u16(256);
+	uint16x8_t c0 = vdupq_n_u16(color[0]);
+	uint16x8_t c1 = vdupq_n_u16(color[1]);
+	uint16x8_t c2 = vdupq_n_u16(color[2]);
+	uint16x8_t c3 = vdupq_n_u16(255);
+	if (!have_neon())
+		return 0;
+	for (; i + 8 <= w; i += 8, dp += 32, mp += 8)
+	{
+		uint16x8_t ma, ima;
+		uint8x8x4_t d;
+		/* outside of shape, common in glyphs and thin strokes */
+		if (zero_8_bytes(mp))
+			continue;
+		ma = vmovl_u8(vld1_u8(mp));
+		ma = EXPAND16(ma);
+		/* FZ_COMBINE of 256 and 256 would not fit in 16 bits */
+		if (sa != 256)
+			ma = COMBINE16(ma, vsa);
+		ima = vsubq_u16(c256, ma);
+		d = vld4_u8(dp);
+		d.val[0] = vmovn_u16(blend16(c0, vmovl_u8(d.val[0]), ma, ima));
+		d.val[1] = vmovn_u16(blend16(c1, vmovl_u8(d.val[1]), ma, ima));
+		d.val[2] = vmovn_u16(blend16(c2, vmovl_u8(d.val[2]), ma, ima));
+		d.val[3] = vmovn_u16(blend16(c3, vmovl_u8(d.val[3]), ma, ima));
+		vst4_u8(dp, d);
+	}
+#endif
+	return i;
+}
+
+int
+fz_paint_span_with_mask_4_simd(byte * restrict dp, const byte * restrict sp, const byte * restrict mp, int w)
+{
+	int i = 0;
+#if defined(APV_PAINT_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i c255 = _mm_set1_epi16(255);
+	for (; i + 4 <= w; i += 4, dp += 16, sp += 16, mp += 4)
+	{
+		unsigned int m4 = load_4_bytes(mp);
+		__m128i malo, mahi, s, d, slo, shi, masa, lo, hi;
+		if (m4 == 0)
+			continue;
+		spread_mask(EXPAND16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m4), zero)), &malo, &mahi);
+		s = _mm_loadu_si128((const __m128i *)sp);
+		d = _mm_loadu_si128((const __m128i *)dp);
+		slo = _mm_unpacklo_epi8(s, zero);
+		shi = _mm_unpackhi_epi8(s, zero);
+		masa = EXPAND16(_mm_sub_epi16(c255, COMBINE16(SPLAT_ALPHA(slo), malo)));
+		lo = _mm_add_epi16(COMBINE16(slo, malo), COMBINE16(_mm_unpacklo_epi8(d, zero), masa));
+		masa = EXPAND16(_mm_sub_epi16(c255, COMBINE16(SPLAT_ALPHA(shi), mahi)));
+		hi = _mm_add_epi16(COMBINE16(shi, mahi), COMBINE16(_mm_unpackhi_epi8(d, zero), masa));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(_mm_and_si128(lo, c255), _mm_and_si128(hi, c255)));
+	}
+#elif defined(APV_PAINT_NEON)
+	uint16x8_t c255 = vdupq_n_u16(255);
+	if (!have_neon())
+		return 0;
+	for (; i + 8 <= w; i += 8, dp += 32, sp += 32, mp += 8)
+	{
+		uint16x8_t ma, masa;
+		uint8x8x4_t s, d;
+		int k;
+		if (zero_8_bytes(mp))
+			continue;
+		ma = vmovl_u8(vld1_u8(mp));
+		ma = EXPAND16(ma);
+		s = vld4_u8(sp);
+		d = vld4_u8(dp);
+		masa = vsubq_u16(c255, COMBINE16(vmovl_u8(s.val[3]), ma));
+		masa = EXPAND16(masa);
+		for (k = 0; k < 4; k++)
+			d.val[k] = vmovn_u16(vaddq_u16(COMBINE16(vmovl_u8(s.val[k]), ma), COMBINE16(vmovl_u8(d.val[k]), masa)));
+		vst4_u8(dp, d);
+	}
+#endif
+	return i;
+}
+
+int
+fz_paint_span_4_with_alpha_simd(byte * restrict dp, const byte * restrict sp, int w, int alpha)
+{
+	int i = 0;
+#if defined(APV_PAINT_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i va = _mm_set1_epi16(FZ_EXPAND(alpha));
+	for (; i + 4 <= w; i += 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i slo = _mm_unpacklo_epi8(s, zero);
+		__m128i shi = _mm_unpackhi_epi8(s, zero);
+		__m128i lo = blend16(slo, _mm_unpacklo_epi8(d, zero), COMBINE16(SPLAT_ALPHA(slo), va));
+		__m128i hi = blend16(shi, _mm_unpackhi_epi8(d, zero), COMBINE16(SPLAT_ALPHA(shi), va));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+#elif defined(APV_PAINT_NEON)
+	uint16x8_t va = vdupq_n_u16(FZ_EXPAND(alpha));
+	uint16x8_t c256 = vdupq_n_u16(256);
+	if (!have_neon())
+		return 0;
+	for (; i + 8 <= w; i += 8, dp += 32, sp += 32)
+	{
+		uint8x8x4_t s = vld4_u8(sp);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint16x8_t masa = COMBINE16(vmovl_u8(s.val[3]), va);
+		uint16x8_t imasa = vsubq_u16(c256, masa);
+		int k;
+		for (k = 0; k < 4; k++)
+			d.val[k] = vmovn_u16(blend16(vmovl_u8(s.val[k]), vmovl_u8(d.val[k]), masa, imasa));
+		vst4_u8(dp, d);
+	}
+#endif
+	return i;
+}
+
+int
+fz_paint_span_4_simd(byte * restrict dp, const byte * restrict sp, int w)
+{
+	int i = 0;
+#if defined(APV_PAINT_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i c255 = _mm_set1_epi16(255);
+	for (; i + 4 <= w; i += 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i slo = _mm_unpacklo_epi8(s, zero);
+		__m128i shi = _mm_unpackhi_epi8(s, zero);
+		__m128i tlo = EXPAND16(_mm_sub_epi16(c255, SPLAT_ALPHA(slo)));
+		__m128i thi = EXPAND16(_mm_sub_epi16(c255, SPLAT_ALPHA(shi)));
+		__m128i lo = _mm_add_epi16(slo, COMBINE16(_mm_unpacklo_epi8(d, zero), tlo));
+		__m128i hi = _mm_add_epi16(shi, COMBINE16(_mm_unpackhi_epi8(d, zero), thi));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(_mm_and_si128(lo, c255), _mm_and_si128(hi, c255)));
+	}
+#elif defined(APV_PAINT_NEON)
+	uint16x8_t c255 = vdupq_n_u16(255);
+	if (!have_neon())
+		return 0;
+	for (; i + 8 <= w; i += 8, dp += 32, sp += 32)
+	{
+		uint8x8x4_t s = vld4_u8(sp);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint16x8_t t = vsubq_u16(c255, vmovl_u8(s.val[3]));
+		int k;
+		t = EXPAND16(t);
+		for (k = 0; k < 4; k++)
+			d.val[k] = vmovn_u16(vaddq_u16(vmovl_u8(s.val[k]), COMBINE16(vmovl_u8(d.val[k]), t)));
+		vst4_u8(dp, d);
+	}
+#endif
+	return i;
+}
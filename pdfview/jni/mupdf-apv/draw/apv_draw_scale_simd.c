@@ -0,0 +1,337 @@
+#include "fitz-internal.h"
+
+/*
+
+SIMD versions of the row scalers of draw_scale.c.
+
+contrib is the weights table of draw_scale.c: for each of count output pixels
+the index of the first source pixel, the number of weights and the weights.
+Horizontal scalers read weights as 16 bit numbers, which they are as long as
+no output pixel has more than SCALE_SIMD_MAX_LEN weights: each weight is at
+most 256 when made, and check_weights either adds at most 256 to one of them
+or takes the excess of their sum over 256 from it, which is less than one
+per weight. Everything else is computed in 32 bits just like the scalar
+code, so results are bit for bit the same.
+
+SSE2 is used on x86, where every Android device has it. NEON code hasn't
+been compared with the scalar code on ARM yet, so it's built only with
+ndk-build APV_NEON=1 (see draw/Android.mk); then it's used on armeabi-v7a
+only if the CPU has it (this file is built with -mfpu=neon there), on arm64
+always. On other CPUs fz_can_scale_simd returns 0 and the scalar code is
+used.
+
+*/
+
+#if defined(__SSE2__)
+#define APV_SCALE_SSE2
+#include <emmintrin.h>
+#elif defined(APV_NEON) && (defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__))
+#define APV_SCALE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <cpu-features.h>
+#endif
+#endif
+
+#define SCALE_SIMD_MAX_LEN 1024
+
+typedef unsigned char byte;
+
+int
+fz_can_scale_simd(int max_len)
+{
+	if (max_len > SCALE_SIMD_MAX_LEN)
+		return 0;
+#if defined(APV_SCALE_SSE2) || (defined(APV_SCALE_NEON) && defined(__aarch64__))
+	return 1;
+#elif defined(APV_SCALE_NEON)
+	/* cached by cpufeatures after first call */
+	return (android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON) != 0;
+#else
+	return 0;
+#endif
+}
+
+void
+fz_scale_row_to_temp1_simd(int *dst, const byte *src, const int *contrib, int count, int flip)
+{
+	int step = 1;
+	int i;
+
+	if (flip)
+	{
+		dst += count - 1;
+		step = -1;
+	}
+	for (i = count; i > 0; i--, dst += step)
+	{
+		const byte *min = &src[*contrib++];
+		int len = *contrib++;
+		int val;
+#if defined(APV_SCALE_SSE2)
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		for (; len >= 8; len -= 8, min += 8, contrib += 8)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_loadu_si128((const __m128i *)(contrib + 4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+		val = _mm_cvtsi128_si32(acc);
+#elif defined(APV_SCALE_NEON)
+		int32x4_t acc = vdupq_n_s32(0);
+		int32x2_t sum;
+		for (; len >= 8; len -= 8, min += 8, contrib += 8)
+		{
+			int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(min)));
+			int16x8_t w = vcombine_s16(vmovn_s32(vld1q_s32(contrib)), vmovn_s32(vld1q_s32(contrib + 4)));
+			acc = vmlal_s16(acc, vget_low_s16(p), vget_low_s16(w));
+			acc = vmlal_s16(acc, vget_high_s16(p), vget_high_s16(w));
+		}
+		sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+		val = vget_lane_s32(sum, 0) + vget_lane_s32(sum, 1);
+#else
+		val = 0;
+#endif
+		while (len-- > 0)
+			val += *min++ * *contrib++;
+		*dst = val;
+	}
+}
+
+void
+fz_scale_row_to_temp2_simd(int *dst, const byte *src, const int *contrib, int count, int flip)
+{
+	int step = 2;
+	int i;
+
+	if (flip)
+	{
+		dst += 2 * (count - 1);
+		step = -2;
+	}
+	for (i = count; i > 0; i--, dst += step)
+	{
+		const byte *min = &src[2 * *contrib++];
+		int len = *contrib++;
+		int c1, c2;
+#if defined(APV_SCALE_SSE2)
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		/* 4 pixels a, b, c, d at a time: a0 b0 a1 b1 c0 d0 c1 d1 times
+		 * w0 w1 w0 w1 w2 w3 w2 w3 gives both components of a+b and c+d */
+		for (; len >= 4; len -= 4, min += 8, contrib += 4)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			__m128i w = _mm_loadu_si128((const __m128i *)contrib);
+			w = _mm_packs_epi32(w, w);
+			w = _mm_unpacklo_epi32(w, w);
+			p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 1, 2, 0));
+			p = _mm_shufflehi_epi16(p, _MM_SHUFFLE(3, 1, 2, 0));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		c1 = _mm_cvtsi128_si32(acc);
+		c2 = _mm_cvtsi128_si32(_mm_srli_si128(acc, 4));
+#elif defined(APV_SCALE_NEON)
+		int32x4_t acc = vdupq_n_s32(0);
+		int32x2_t sum;
+		/* 4 pixels at a time, each weight repeated for both components */
+		for (; len >= 4; len -= 4, min += 8, contrib += 4)
+		{
+			int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(min)));
+			int16x4_t w = vmovn_s32(vld1q_s32(contrib));
+			int16x4x2_t ww = vzip_s16(w, w);
+			acc = vmlal_s16(acc, vget_low_s16(p), ww.val[0]);
+			acc = vmlal_s16(acc, vget_high_s16(p), ww.val[1]);
+		}
+		sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+		c1 = vget_lane_s32(sum, 0);
+		c2 = vget_lane_s32(sum, 1);
+#else
+		c1 = 0;
+		c2 = 0;
+#endif
+		while (len-- > 0)
+		{
+			c1 += *min++ * *contrib;
+			c2 += *min++ * *contrib++;
+		}
+		dst[0] = c1;
+		dst[1] = c2;
+	}
+}
+
+void
+fz_scale_row_to_temp4_simd(int *dst, const byte *src, const int *contrib, int count, int flip)
+{
+	int step = 4;
+	int i;
+
+	if (flip)
+	{
+		dst += 4 * (count - 1);
+		step = -4;
+	}
+	for (i = count; i > 0; i--, dst += step)
+	{
+		const byte *min = &src[4 * *contrib++];
+		int len = *contrib++;
+#if defined(APV_SCALE_SSE2)
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		/* 2 pixels a, b at a time: a0 b0 a1 b1 a2 b2 a3 b3 times w0 w1 */
+		for (; len >= 2; len -= 2, min += 8, contrib += 2)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			__m128i w = _mm_loadl_epi64((const __m128i *)contrib);
+			w = _mm_shuffle_epi32(_mm_packs_epi32(w, w), 0);
+			p = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+		}
+		if (len > 0)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(min[0] | (min[1] << 8) | (min[2] << 16) | ((unsigned int)min[3] << 24)), zero);
+			__m128i w = _mm_set1_epi32(*contrib++ & 0xffff);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p, zero), w));
+		}
+		_mm_storeu_si128((__m128i *)dst, acc);
+#elif defined(APV_SCALE_NEON)
+		int32x4_t acc = vdupq_n_s32(0);
+		for (; len >= 2; len -= 2, min += 8, contrib += 2)
+		{
+			int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(min)));
+			acc = vmlal_n_s16(acc, vget_low_s16(p), contrib[0]);
+			acc = vmlal_n_s16(acc, vget_high_s16(p), contrib[1]);
+		}
+		vst1q_s32(dst, acc);
+		if (len > 0)
+		{
+			dst[0] += min[0] * *contrib;
+			dst[1] += min[1] * *contrib;
+			dst[2] += min[2] * *contrib;
+			dst[3] += min[3] * *contrib++;
+		}
+#else
+		dst[0] = dst[1] = dst[2] = dst[3] = 0;
+		while (len-- > 0)
+		{
+			dst[0] += *min++ * *contrib;
+			dst[1] += *min++ * *contrib;
+			dst[2] += *min++ * *contrib;
+			dst[3] += *min++ * *contrib++;
+		}
+#endif
+	}
+}
+
+#if defined(APV_SCALE_SSE2)
+
+/* low 32 bits of products of 32 bit lanes by w, which has no such SSE2
+ * instruction: even and odd lanes are multiplied to 64 bits separately and
+ * summed as such, and recombined in pack_products */
+static inline void
+mul_add_32(__m128i *even, __m128i *odd, __m128i v, __m128i w)
+{
+	*even = _mm_add_epi64(*even, _mm_mul_epu32(v, w));
+	*odd = _mm_add_epi64(*odd, _mm_mul_epu32(_mm_srli_epi64(v, 32), w));
+}
+
+static inline __m128i
+pack_products(__m128i even, __m128i odd)
+{
+	even = _mm_shuffle_epi32(even, _MM_SHUFFLE(3, 1, 2, 0));
+	odd = _mm_shuffle_epi32(odd, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_unpacklo_epi32(even, odd);
+}
+
+#endif
+
+void
+fz_scale_row_from_temp_simd(byte *dst, const int *src, const int *contrib, int len, int width)
+{
+	int x = 0;
+#if defined(APV_SCALE_SSE2)
+	__m128i round = _mm_set1_epi32(1 << 15);
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i e0 = _mm_setzero_si128();
+		__m128i o0 = e0, e1 = e0, o1 = e0;
+		__m128i v0, v1;
+		const int *min = src + x;
+		int k;
+		for (k = 0; k < len; k++, min += width)
+		{
+			__m128i w = _mm_set1_epi32(contrib[k]);
+			mul_add_32(&e0, &o0, _mm_loadu_si128((const __m128i *)min), w);
+			mul_add_32(&e1, &o1, _mm_loadu_si128((const __m128i *)(min + 4)), w);
+		}
+		v0 = _mm_srai_epi32(_mm_add_epi32(pack_products(e0, o0), round), 16);
+		v1 = _mm_srai_epi32(_mm_add_epi32(pack_products(e1, o1), round), 16);
+		v0 = _mm_packs_epi32(v0, v1);
+		_mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(v0, v0));
+	}
+#elif defined(APV_SCALE_NEON)
+	for (; x + 8 <= width; x += 8)
+	{
+		int32x4_t a0 = vdupq_n_s32(0);
+		int32x4_t a1 = a0;
+		const int *min = src + x;
+		int k;
+		for (k = 0; k < len; k++, min += width)
+		{
+			a0 = vmlaq_n_s32(a0, vld1q_s32(min), contrib[k]);
+			a1 = vmlaq_n_s32(a1, vld1q_s32(min + 4), contrib[k]);
+		}
+		/* rounding shift, then saturate to 16 bits and to 0..255 */
+		vst1_u8(dst + x, vqmovun_s16(vcombine_s16(vqmovn_s32(vrshrq_n_s32(a0, 16)), vqmovn_s32(vrshrq_n_s32(a1, 16)))));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		const int *min = src + x;
+		int val = 0;
+		int k;
+		for (k = 0; k < len; k++, min += width)
+			val += *min * contrib[k];
+		val = (val+(1<<15))>>16;
+		if (val < 0)
+			val = 0;
+		else if (val > 255)
+			val = 255;
+		dst[x] = val;
+	}
+}
+
+void
+fz_scale_add_row_simd(int *acc, const byte *src, int len)
+{
+	int i = 0;
+#if defined(APV_SCALE_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i *a = (__m128i *)(acc + i);
+		_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+	}
+#elif defined(APV_SCALE_NEON)
+	for (; i + 8 <= len; i += 8)
+	{
+		uint16x8_t v = vmovl_u8(vld1_u8(src + i));
+		int32x4_t a0 = vld1q_s32(acc + i);
+		int32x4_t a1 = vld1q_s32(acc + i + 4);
+		vst1q_s32(acc + i, vaddq_s32(a0, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(v)))));
+		vst1q_s32(acc + i + 4, vaddq_s32(a1, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(v)))));
+	}
+#endif
+	for (; i < len; i++)
+		acc[i] += src[i];
+}
@@ -18,15 +18,37 @@ endif
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mupdf $(LOCAL_PATH)/../fitz
 LOCAL_MODULE    := fitzdraw
 LOCAL_SRC_FILES := \
-	draw_device.c \
+	../../mupdf-apv/draw/apv_draw_affine.c \
+	../../mupdf-apv/draw/apv_draw_device.c \
+	../../mupdf-apv/draw/apv_draw_edge.c \
+	../../mupdf-apv/draw/apv_draw_glyph.c \
+	../../mupdf-apv/draw/apv_draw_paint.c \
+	../../mupdf-apv/draw/apv_draw_paint_simd.c \
+	../../mupdf-apv/draw/apv_draw_path.c \
+	../../mupdf-apv/draw/apv_draw_scale.c \
+	../../mupdf-apv/draw/apv_draw_scale_simd.c \
+	\
 	draw_blend.c \
-	draw_glyph.c \
-	draw_affine.c \
-	draw_scale.c \
 	draw_unpack.c \
-	draw_mesh.c \
-	draw_path.c \
-	draw_paint.c \
-	draw_edge.c
+	draw_mesh.c
+
+# NEON painters and scalers are built only with ndk-build APV_NEON=1 until
+# they are checked against scalar code on ARM with aptn_paint and aptn_scale;
+# then they are used only if CPU has NEON, see apv_draw_paint_simd.c and
+# apv_draw_scale_simd.c
+ifeq ($(APV_NEON),1)
+	LOCAL_CFLAGS += -DAPV_NEON
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+	LOCAL_SRC_FILES := $(patsubst %/apv_draw_paint_simd.c,%/apv_draw_paint_simd.c.neon,$(LOCAL_SRC_FILES))
+	LOCAL_SRC_FILES := $(patsubst %/apv_draw_scale_simd.c,%/apv_draw_scale_simd.c.neon,$(LOCAL_SRC_FILES))
+	LOCAL_STATIC_LIBRARIES := cpufeatures
+endif
+endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+ifeq ($(APV_NEON),1)
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+$(call import-module,android/cpufeatures)
+endif
+endif
@@ -25,6 +25,13 @@ LOCAL_C_INCLUDES := \
 LOCAL_MODULE := fitz
 LOCAL_SRC_FILES := \
 	../../mupdf-apv/fitz/apv_doc_document.c \
+	../../mupdf-apv/fitz/apv_filt_dctd.c \
+	../../mupdf-apv/fitz/apv_filt_faxd.c \
+	../../mupdf-apv/fitz/apv_filt_jbig2d.c \
+	../../mupdf-apv/fitz/apv_image_jpx.c \
+	../../mupdf-apv/fitz/apv_res_image.c \
+	../../mupdf-apv/fitz/apv_res_store.c \
+	../../mupdf-apv/fitz/apv_text_extract.c \
 	../../mupdf-apv/fitz/ucdn.c \
 	\
 	base_context.c \
@@ -47,15 +54,11 @@ LOCAL_SRC_FILES := \
 	doc_outline.c \
 	\
 	filt_basic.c \
-	filt_dctd.c \
-	filt_faxd.c \
 	filt_flate.c \
 	filt_lzwd.c \
 	filt_predict.c \
-	filt_jbig2d.c \
 	\
 	image_jpeg.c \
-	image_jpx.c \
 	image_tiff.c \
 	image_png.c \
 	\
@@ -63,11 +66,9 @@ LOCAL_SRC_FILES := \
 	res_colorspace.c \
 	res_font.c \
 	res_func.c \
-	res_image.c \
 	res_path.c \
 	res_pixmap.c \
 	res_shade.c \
-	res_store.c \
 	res_text.c \
 	\
 	stm_buffer.c \
@@ -76,7 +77,6 @@ LOCAL_SRC_FILES := \
 	stm_read.c \
 	stm_output.c \
 	\
-	text_extract.c \
 	text_output.c \
 	text_paragraph.c \
 	text_search.c \
@@ -21,7 +21,15 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)/../fitz \
 LOCAL_MODULE    := pdf
 LOCAL_SRC_FILES := \
 	../../mupdf-apv/pdf/apv_pdf_cmap_table.c \
+	../../mupdf-apv/pdf/apv_pdf_font.c \
 	../../mupdf-apv/pdf/apv_pdf_fontfile.c \
+	../../mupdf-apv/pdf/apv_pdf_image.c \
+	../../mupdf-apv/pdf/apv_pdf_page.c \
+	../../mupdf-apv/pdf/apv_pdf_repair.c \
+	../../mupdf-apv/pdf/apv_pdf_stream.c \
+	../../mupdf-apv/pdf/apv_pdf_type3.c \
+	../../mupdf-apv/pdf/apv_pdf_xref.c \
+	../../mupdf-apv/pdf/apv_pdf_xref_aux.c \
 	hashmap.c \
 	pdf_annot.c \
 	pdf_cmap.c \
@@ -33,10 +41,8 @@ LOCAL_SRC_FILES := \
 	pdf_encoding.c \
 	pdf_event.c \
 	pdf_field.c \
-	pdf_font.c \
 	pdf_form.c \
 	pdf_function.c \
-	pdf_image.c \
 	pdf_interpret.c \
 	pdf_js_none.c \
 	pdf_lex.c \
@@ -44,19 +50,13 @@ LOCAL_SRC_FILES := \
 	pdf_nametree.c \
 	pdf_object.c \
 	pdf_outline.c \
-	pdf_page.c \
 	pdf_parse.c \
 	pdf_pattern.c \
-	pdf_repair.c \
 	pdf_shade.c \
 	pdf_store.c \
-	pdf_stream.c \
-	pdf_type3.c \
 	pdf_unicode.c \
 	pdf_write.c \
-	pdf_xobject.c \
-	pdf_xref.c \
-	pdf_xref_aux.c
+	pdf_xobject.c
 
 
 
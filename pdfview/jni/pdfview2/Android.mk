@@ -8,6 +8,6 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/../mupdf/fitz $(LOCAL_PATH)/../mupdf/pdf $(LOC
 LOCAL_LDLIBS := -L$(SYSROOT)/usr/lib -lz -llog
 LOCAL_STATIC_LIBRARIES := pdf fitz fitzdraw jpeg jbig2dec openjpeg freetype
 LOCAL_MODULE    := apv
-LOCAL_SRC_FILES := apvcore.c apvandroid.c
+LOCAL_SRC_FILES := apvcore.c apvandroid.c apvexport.c apvstream.c apvcache.c apvfingerprint.c apvimages.c
 
 include $(BUILD_SHARED_LIBRARY)
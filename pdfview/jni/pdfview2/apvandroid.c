@@ -1,12 +1,14 @@
 
 #include <string.h>
 #include <wctype.h>
+#include <pthread.h>
 #include <jni.h>
 
 #include "android/log.h"
 
 #include "apvcore.h"
 #include "apvandroid.h"
+#include "apvjni.h"
 
 #include "mupdf-internal.h"
 
@@ -15,14 +17,54 @@
 
 static JavaVM *cached_jvm = NULL;
 
+apv_jni_ids_t apv_jni_ids;
+
 apv_alloc_state_t *apv_alloc_state = NULL;
 fz_alloc_context *fitz_alloc_context = NULL;
+fz_locks_context *fitz_locks_context = NULL;
 fz_context *fitz_context = NULL;
 
+/* guards pdf_ptr fields: pdf_t must not be freed between reading pdf_ptr and locking its users_lock */
+static pthread_mutex_t pdf_ptr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t thread_context_key;
+static pthread_once_t thread_context_key_once = PTHREAD_ONCE_INIT;
+
 
 int get_descriptor_from_file_descriptor(JNIEnv *env, jobject this);
 
 
+static void free_thread_context(void *ctx) {
+    fz_free_context((fz_context*)ctx);
+}
+
+
+static void create_thread_context_key() {
+    pthread_key_create(&thread_context_key, free_thread_context);
+}
+
+
+/**
+ * Get fitz context of calling thread.
+ * Context is cloned from fitz_context on first use and freed when thread exits.
+ * @return context or NULL on error
+ */
+fz_context *get_thread_context() {
+    fz_context *ctx = NULL;
+    pthread_once(&thread_context_key_once, create_thread_context_key);
+    ctx = pthread_getspecific(thread_context_key);
+    if (ctx == NULL) {
+        ctx = fz_clone_context(fitz_context);
+        if (ctx == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to clone fitz context");
+            return NULL;
+        }
+        pthread_setspecific(thread_context_key, ctx);
+    }
+    return ctx;
+}
+
+
 void apv_log_print(const char *file, int line, int level, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -38,10 +80,138 @@ JavaVM *apv_get_cached_jvm() {
 }
 
 
+/**
+ * Find class and return global ref to it.
+ * @return global class ref or NULL if class was not found
+ */
+static jclass find_global_class(JNIEnv *env, const char *name) {
+    jclass local_class = NULL;
+    jclass global_class = NULL;
+    local_class = (*env)->FindClass(env, name);
+    if (local_class == NULL || (*env)->ExceptionCheck(env)) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "class %s not found", name);
+        /* no other JNI calls are allowed while NoClassDefFoundError is pending */
+        (*env)->ExceptionClear(env);
+        return NULL;
+    }
+    global_class = (*env)->NewGlobalRef(env, local_class);
+    (*env)->DeleteLocalRef(env, local_class);
+    return global_class;
+}
+
+
+/**
+ * Log missing class member and clear NoSuchFieldError or NoSuchMethodError.
+ * @return 0 if id is not NULL, -1 otherwise
+ */
+static int check_jni_id(JNIEnv *env, const void *id, const char *class_name, const char *name) {
+    if (id == NULL || (*env)->ExceptionCheck(env)) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "%s.%s not found", class_name, name);
+        (*env)->ExceptionClear(env);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Delete global class refs held by apv_jni_ids and forget all ids.
+ */
+static void free_jni_ids(JNIEnv *env) {
+    apv_jni_ids_t *ids = &apv_jni_ids;
+    jclass classes[] = {
+        ids->pdf_class,
+        ids->size_class,
+        ids->find_result_class,
+        ids->array_list_class,
+        ids->file_descriptor_class,
+        ids->export_progress_listener_class
+    };
+    int i = 0;
+    for(i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        if (classes[i] != NULL) (*env)->DeleteGlobalRef(env, classes[i]);
+    }
+    memset(ids, 0, sizeof(apv_jni_ids_t));
+}
+
+
+/**
+ * Resolve all classes, methods and fields used by native code into apv_jni_ids.
+ * Called once from JNI_OnLoad, so that lookups are not repeated on every call
+ * and missing members are reported when library is loaded.
+ * Stops at first missing class or member, since each failed lookup leaves an
+ * exception that has to be cleared before next JNI call.
+ * @return 0 on success, -1 if anything could not be found
+ */
+static int cache_jni_ids(JNIEnv *env) {
+    apv_jni_ids_t *ids = &apv_jni_ids;
+
+    memset(ids, 0, sizeof(apv_jni_ids_t));
+
+    ids->pdf_class = find_global_class(env, "cx/hell/android/lib/pdf/PDF");
+    if (ids->pdf_class == NULL) return -1;
+    ids->size_class = find_global_class(env, "cx/hell/android/lib/pdf/PDF$Size");
+    if (ids->size_class == NULL) return -1;
+    ids->find_result_class = find_global_class(env, "cx/hell/android/lib/pagesview/FindResult");
+    if (ids->find_result_class == NULL) return -1;
+    ids->array_list_class = find_global_class(env, "java/util/ArrayList");
+    if (ids->array_list_class == NULL) return -1;
+    ids->file_descriptor_class = find_global_class(env, "java/io/FileDescriptor");
+    if (ids->file_descriptor_class == NULL) return -1;
+    ids->export_progress_listener_class = find_global_class(env, "cx/hell/android/lib/pdf/PDF$ExportProgressListener");
+    if (ids->export_progress_listener_class == NULL) return -1;
+
+    ids->pdf_ptr_field_id = (*env)->GetFieldID(env, ids->pdf_class, "pdf_ptr", "I");
+    if (check_jni_id(env, ids->pdf_ptr_field_id, "PDF", "pdf_ptr") != 0) return -1;
+    ids->pdf_invalid_password_field_id = (*env)->GetFieldID(env, ids->pdf_class, "invalid_password", "I");
+    if (check_jni_id(env, ids->pdf_invalid_password_field_id, "PDF", "invalid_password") != 0) return -1;
+    ids->pdf_get_font_data_method_id = (*env)->GetStaticMethodID(env, ids->pdf_class, "getFontData", "(Ljava/lang/String;)[B");
+    if (check_jni_id(env, ids->pdf_get_font_data_method_id, "PDF", "getFontData") != 0) return -1;
+    ids->pdf_get_cmap_data_method_id = (*env)->GetStaticMethodID(env, ids->pdf_class, "getCmapData", "(Ljava/lang/String;)[B");
+    if (check_jni_id(env, ids->pdf_get_cmap_data_method_id, "PDF", "getCmapData") != 0) return -1;
+
+    ids->size_width_field_id = (*env)->GetFieldID(env, ids->size_class, "width", "I");
+    if (check_jni_id(env, ids->size_width_field_id, "PDF.Size", "width") != 0) return -1;
+    ids->size_height_field_id = (*env)->GetFieldID(env, ids->size_class, "height", "I");
+    if (check_jni_id(env, ids->size_height_field_id, "PDF.Size", "height") != 0) return -1;
+
+    ids->find_result_constructor_id = (*env)->GetMethodID(env, ids->find_result_class, "<init>", "()V");
+    if (check_jni_id(env, ids->find_result_constructor_id, "FindResult", "<init>") != 0) return -1;
+    ids->find_result_page_field_id = (*env)->GetFieldID(env, ids->find_result_class, "page", "I");
+    if (check_jni_id(env, ids->find_result_page_field_id, "FindResult", "page") != 0) return -1;
+    ids->find_result_add_marker_method_id = (*env)->GetMethodID(env, ids->find_result_class, "addMarker", "(IIII)V");
+    if (check_jni_id(env, ids->find_result_add_marker_method_id, "FindResult", "addMarker") != 0) return -1;
+
+    ids->array_list_constructor_id = (*env)->GetMethodID(env, ids->array_list_class, "<init>", "()V");
+    if (check_jni_id(env, ids->array_list_constructor_id, "ArrayList", "<init>") != 0) return -1;
+    ids->array_list_add_method_id = (*env)->GetMethodID(env, ids->array_list_class, "add", "(Ljava/lang/Object;)Z");
+    if (check_jni_id(env, ids->array_list_add_method_id, "ArrayList", "add") != 0) return -1;
+
+    /* this is undocumented private field */
+    ids->file_descriptor_descriptor_field_id = (*env)->GetFieldID(env, ids->file_descriptor_class, "descriptor", "I");
+    if (check_jni_id(env, ids->file_descriptor_descriptor_field_id, "FileDescriptor", "descriptor") != 0) return -1;
+
+    ids->export_progress_listener_on_export_progress_method_id = (*env)->GetMethodID(env, ids->export_progress_listener_class, "onExportProgress", "(II)Z");
+    if (check_jni_id(env, ids->export_progress_listener_on_export_progress_method_id, "PDF.ExportProgressListener", "onExportProgress") != 0) return -1;
+
+    return 0;
+}
+
+
 JNIEXPORT jint JNICALL
 JNI_OnLoad(JavaVM *jvm, void *reserved) {
+    JNIEnv *env = NULL;
     __android_log_print(ANDROID_LOG_INFO, PDFVIEW_LOG_TAG, "JNI_OnLoad");
     cached_jvm = jvm;
+    if ((*jvm)->GetEnv(jvm, (void**)&env, JNI_VERSION_1_4) != JNI_OK) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to get JNI environment");
+        return JNI_ERR;
+    }
+    if (cache_jni_ids(env) != 0) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to resolve JNI ids");
+        free_jni_ids(env);
+        return JNI_ERR;
+    }
     return JNI_VERSION_1_4;
 }
 
@@ -72,12 +242,17 @@ Java_cx_hell_android_lib_pdf_PDF_init(
         fitz_alloc_context->realloc = apv_realloc;
         fitz_alloc_context->free = apv_free;
     }
+    if (fitz_locks_context != NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "fitz_locks_context is not NULL");
+    } else {
+        fitz_locks_context = apv_new_locks_context();
+    }
     if (fitz_context != NULL) {
         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "fitz_context is not NULL");
     } else {
         // fz_context *fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, unsigned int max_store);
         __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "creating fitz_context with max_store: %d", (int)max_store);
-        fitz_context = fz_new_context(fitz_alloc_context, NULL, max_store);
+        fitz_context = fz_new_context(fitz_alloc_context, fitz_locks_context, max_store);
         if (fitz_context == NULL) {
             __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to create fitz_context"); // TODO: display error to user
         }
@@ -94,6 +269,28 @@ Java_cx_hell_android_lib_pdf_PDF_deinit(
 }
 
 
+/**
+ * Implementation of native method PDF.setCacheDir.
+ * Sets directory for xref and page info cache files, null disables cache.
+ */
+JNIEXPORT void JNICALL
+Java_cx_hell_android_lib_pdf_PDF_setCacheDir(
+        JNIEnv *env,
+        jclass clazz,
+        jstring dir) {
+    const char *c_dir = NULL;
+    jboolean iscopy;
+    if (dir == NULL) {
+        apv_set_cache_dir(NULL);
+        return;
+    }
+    c_dir = (*env)->GetStringUTFChars(env, dir, &iscopy);
+    if (c_dir == NULL) return;
+    apv_set_cache_dir(c_dir);
+    (*env)->ReleaseStringUTFChars(env, dir, c_dir);
+}
+
+
 /**
  * Implementation of native method PDF.parseFile.
  * Opens file and parses at least some bytes - so it could take a while.
@@ -110,16 +307,12 @@ Java_cx_hell_android_lib_pdf_PDF_parseFile(
     const char *c_file_name = NULL;
     const char *c_password = NULL;
     jboolean iscopy;
-    jclass this_class;
-    jfieldID pdf_field_id;
-    jfieldID invalid_password_field_id;
+    jfieldID pdf_field_id = apv_jni_ids.pdf_ptr_field_id;
+    jfieldID invalid_password_field_id = apv_jni_ids.pdf_invalid_password_field_id;
     pdf_t *pdf = NULL;
 
     c_file_name = (*env)->GetStringUTFChars(env, file_name, &iscopy);
     c_password = (*env)->GetStringUTFChars(env, password, &iscopy);
-    this_class = (*env)->GetObjectClass(env, jthis);
-    pdf_field_id = (*env)->GetFieldID(env, this_class, "pdf_ptr", "I");
-    invalid_password_field_id = (*env)->GetFieldID(env, this_class, "invalid_password", "I");
     pdf = parse_pdf_file(c_file_name, 0, c_password, fitz_context, fitz_alloc_context, apv_alloc_state);
 
     if (pdf != NULL && pdf->invalid_password) {
@@ -140,9 +333,12 @@ Java_cx_hell_android_lib_pdf_PDF_parseFile(
 
     (*env)->ReleaseStringUTFChars(env, file_name, c_file_name);
     (*env)->ReleaseStringUTFChars(env, password, c_password);
-    (*env)->SetIntField(env, jthis, pdf_field_id, (int)pdf);
 
-    maybe_free_cache(pdf);
+    if (pdf != NULL) maybe_free_cache(pdf);
+
+    pthread_mutex_lock(&pdf_ptr_lock);
+    (*env)->SetIntField(env, jthis, pdf_field_id, (int)pdf);
+    pthread_mutex_unlock(&pdf_ptr_lock);
 }
 
 
@@ -158,17 +354,13 @@ Java_cx_hell_android_lib_pdf_PDF_parseFileDescriptor(
         jstring password
         ) {
     int fileno;
-    jclass this_class;
-    jfieldID pdf_field_id;
+    jfieldID pdf_field_id = apv_jni_ids.pdf_ptr_field_id;
     pdf_t *pdf = NULL;
-    jfieldID invalid_password_field_id;
+    jfieldID invalid_password_field_id = apv_jni_ids.pdf_invalid_password_field_id;
     jboolean iscopy;
     const char* c_password;
 
     c_password = (*env)->GetStringUTFChars(env, password, &iscopy);
-	this_class = (*env)->GetObjectClass(env, jthis);
-	pdf_field_id = (*env)->GetFieldID(env, this_class, "pdf_ptr", "I");
-    invalid_password_field_id = (*env)->GetFieldID(env, this_class, "invalid_password", "I");
 
     fileno = get_descriptor_from_file_descriptor(env, fileDescriptor);
 	pdf = parse_pdf_file(NULL, fileno, c_password, fitz_context, fitz_alloc_context, apv_alloc_state);
@@ -189,7 +381,9 @@ Java_cx_hell_android_lib_pdf_PDF_parseFileDescriptor(
             strcpy(pdf->box, boxes[box_type]);
     }
     (*env)->ReleaseStringUTFChars(env, password, c_password);
+    pthread_mutex_lock(&pdf_ptr_lock);
     (*env)->SetIntField(env, jthis, pdf_field_id, (int)pdf);
+    pthread_mutex_unlock(&pdf_ptr_lock);
 }
 
 
@@ -205,12 +399,93 @@ Java_cx_hell_android_lib_pdf_PDF_getPageCount(
 		JNIEnv *env,
 		jobject this) {
 	pdf_t *pdf = NULL;
-    pdf = get_pdf_from_this(env, this);
+    int count = 0;
+    pdf = acquire_pdf_from_this(env, this);
 	if (pdf == NULL) {
         // __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "pdf is null");
         return -1;
     }
-	return fz_count_pages(pdf->doc);
+    pthread_mutex_lock(&pdf->doc_lock);
+	count = get_page_count(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    release_pdf(pdf);
+    return count;
+}
+
+
+/**
+ * Implementation of native method PDF.hasFastFirstPage.
+ * @return true if first page can be shown before sizes of other pages are known,
+ * see has_fast_first_page
+ */
+JNIEXPORT jboolean JNICALL
+Java_cx_hell_android_lib_pdf_PDF_hasFastFirstPage(
+		JNIEnv *env,
+		jobject this) {
+	pdf_t *pdf = NULL;
+    int fast = 0;
+    pdf = acquire_pdf_from_this(env, this);
+	if (pdf == NULL) return JNI_FALSE;
+    pthread_mutex_lock(&pdf->doc_lock);
+    fast = has_fast_first_page(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    release_pdf(pdf);
+    return fast ? JNI_TRUE : JNI_FALSE;
+}
+
+
+/**
+ * Implementation of native method PDF.getOpenStats.
+ * @return time in microseconds and bytes read from storage of each open phase,
+ * interleaved in phase order, -1 for phases that did not run yet
+ */
+JNIEXPORT jlongArray JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getOpenStats(
+        JNIEnv *env,
+        jobject this) {
+    pdf_t *pdf = NULL;
+    jlong stats[2 * APV_OPEN_PHASES];
+    jlongArray result = NULL;
+    int i = 0;
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) return NULL;
+    pthread_mutex_lock(&pdf->doc_lock);
+    for(i = 0; i < APV_OPEN_PHASES; ++i) {
+        if (pdf->open_stats[i].done) {
+            stats[2*i] = pdf->open_stats[i].time_us;
+            stats[2*i+1] = pdf->open_stats[i].read_bytes;
+        } else {
+            stats[2*i] = -1;
+            stats[2*i+1] = -1;
+        }
+    }
+    pthread_mutex_unlock(&pdf->doc_lock);
+    release_pdf(pdf);
+    result = (*env)->NewLongArray(env, 2 * APV_OPEN_PHASES);
+    if (result == NULL) return NULL;
+    (*env)->SetLongArrayRegion(env, result, 0, 2 * APV_OPEN_PHASES, stats);
+    return result;
+}
+
+
+/**
+ * Implementation of native method PDF.getFingerprint.
+ * @return fingerprint of document contents as hex string, null if it is not known
+ */
+JNIEXPORT jstring JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getFingerprint(
+        JNIEnv *env,
+        jobject this) {
+    pdf_t *pdf = NULL;
+    char hex[17];
+    int valid = 0;
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) return NULL;
+    valid = pdf->file_id.valid;
+    snprintf(hex, sizeof(hex), "%016llx", pdf->file_id.fingerprint);
+    release_pdf(pdf);
+    if (!valid) return NULL;
+    return (*env)->NewStringUTF(env, hex);
 }
 
 
@@ -223,7 +498,8 @@ Java_cx_hell_android_lib_pdf_PDF_renderPage(
         jint left,
         jint top,
         jint rotation,
-        jboolean skipImages,
+        jint aaLevel,
+        jintArray imageDetail,
         jobject size) {
     jintArray jints; /* return value */
     int *jbuf = NULL; /* points to jints internal array */
@@ -232,8 +508,11 @@ Java_cx_hell_android_lib_pdf_PDF_renderPage(
     int height = 0;
     int num_pixels = 0;
     fz_pixmap *image = NULL;
+    fz_context *ctx = NULL;
+    jint image_detail = APV_IMAGES_FULL; /* in: wanted, out: detail of rendered tile */
 
     get_size(env, size, &width, &height);
+    (*env)->GetIntArrayRegion(env, imageDetail, 0, 1, &image_detail);
 
     /*
     __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "jni renderPage(pageno: %d, zoom: %d, left: %d, top: %d, width: %d, height: %d) start",
@@ -242,26 +521,36 @@ Java_cx_hell_android_lib_pdf_PDF_renderPage(
             (int)width, (int)height);
     */
 
-    pdf = get_pdf_from_this(env, this);
+    ctx = get_thread_context();
+    if (ctx == NULL) return NULL;
+
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return NULL;
+    }
 
     APV_LOG_PRINT(APV_LOG_DEBUG, "rendering page %d", pageno);
-    image = get_page_image_bitmap(pdf, pageno, zoom, left, top, rotation, skipImages, width, height);
-    num_pixels = fz_pixmap_width(pdf->ctx, image) * fz_pixmap_height(pdf->ctx, image);
+    image = get_page_image_bitmap(pdf, ctx, pageno, zoom, left, top, rotation, aaLevel, (int*)&image_detail, width, height);
+    release_pdf(pdf);
+    if (image == NULL) return NULL;
+
+    num_pixels = fz_pixmap_width(ctx, image) * fz_pixmap_height(ctx, image);
     jints = (*env)->NewIntArray(env, num_pixels);
 	jbuf = (*env)->GetIntArrayElements(env, jints, NULL);
-    memcpy(jbuf, fz_pixmap_samples(pdf->ctx, image), num_pixels * 4);
+    memcpy(jbuf, fz_pixmap_samples(ctx, image), num_pixels * 4);
     (*env)->ReleaseIntArrayElements(env, jints, jbuf, 0);
-    width = fz_pixmap_width(pdf->ctx, image);
-    height = fz_pixmap_height(pdf->ctx, image);
-    fz_drop_pixmap(pdf->ctx, image);
+    width = fz_pixmap_width(ctx, image);
+    height = fz_pixmap_height(ctx, image);
+    fz_drop_pixmap(ctx, image);
 
-    if (jints != NULL)
+    if (jints != NULL) {
         save_size(env, size, width, height);
+        (*env)->SetIntArrayRegion(env, imageDetail, 0, 1, &image_detail);
+    }
 
     APV_LOG_PRINT(APV_LOG_DEBUG, "rendered page, width: %d, height: %d", width, height);
 
-    maybe_free_cache(pdf);
-
     return jints;
 }
 
@@ -275,13 +564,17 @@ Java_cx_hell_android_lib_pdf_PDF_getPageSize(
     int width, height, error;
     pdf_t *pdf = NULL;
 
-    pdf = get_pdf_from_this(env, this);
+    pdf = acquire_pdf_from_this(env, this);
     if (pdf == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
         return 1;
     }
 
+    pthread_mutex_lock(&pdf->doc_lock);
     error = get_page_size(pdf, pageno, &width, &height);
+    maybe_free_cache(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    release_pdf(pdf);
     if (error != 0) {
         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "get_page_size error: %d", (int)error);
         return 2;
@@ -291,8 +584,6 @@ Java_cx_hell_android_lib_pdf_PDF_getPageSize(
 
     save_size(env, size, width, height);
 
-    maybe_free_cache(pdf);
-
     return 0;
 }
 
@@ -337,10 +628,12 @@ Java_cx_hell_android_lib_pdf_PDF_getHeapSize(
         JNIEnv *env,
         jobject this) {
     pdf_t *pdf = NULL;
-    jclass this_class = (*env)->GetObjectClass(env, this);
-    jfieldID pdf_field_id = (*env)->GetFieldID(env, this_class, "pdf_ptr", "I");
-    pdf = (pdf_t*) (*env)->GetIntField(env, this, pdf_field_id);
-    return pdf->alloc_state->current_size;
+    int size = 0;
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) return 0;
+    size = pdf->alloc_state->current_size;
+    release_pdf(pdf);
+    return size;
 }
 
 
@@ -353,12 +646,14 @@ Java_cx_hell_android_lib_pdf_PDF_freeMemory(
         JNIEnv *env,
         jobject this) {
     pdf_t *pdf = NULL;
-	jclass this_class = (*env)->GetObjectClass(env, this);
-	jfieldID pdf_field_id = (*env)->GetFieldID(env, this_class, "pdf_ptr", "I");
+	jfieldID pdf_field_id = apv_jni_ids.pdf_ptr_field_id;
 
+    pthread_mutex_lock(&pdf_ptr_lock);
 	pdf = (pdf_t*) (*env)->GetIntField(env, this, pdf_field_id);
 	(*env)->SetIntField(env, this, pdf_field_id, 0);
+    pthread_mutex_unlock(&pdf_ptr_lock);
     if (pdf) {
+        /* waits for calls that still use pdf */
         free_pdf_t(pdf);
         pdf = NULL;
     }
@@ -369,73 +664,112 @@ Java_cx_hell_android_lib_pdf_PDF_freeMemory(
 }
 
 
-#if 0
-JNIEXPORT void JNICALL
-Java_cx_hell_android_pdfview_PDF_export(
+/**
+ * Passed to export_text as progress callback user data.
+ */
+typedef struct {
+    JNIEnv *env;
+    jobject listener;
+    jmethodID method_id;
+} export_progress_t;
+
+
+/**
+ * Forward export progress to PDF.ExportProgressListener.
+ * Listener returns false to abort export.
+ */
+int export_text_progress(void *user, int pages_done, int pages_total) {
+    export_progress_t *progress = user;
+    jboolean go_on = JNI_TRUE;
+    if (progress->listener == NULL) return 0;
+    go_on = (*progress->env)->CallBooleanMethod(progress->env, progress->listener, progress->method_id, pages_done, pages_total);
+    if ((*progress->env)->ExceptionCheck(progress->env)) return 1;
+    return go_on ? 0 : 1;
+}
+
+
+/**
+ * Implementation of native method PDF.exportText.
+ * Writes UTF-8 text of pages first_page..last_page to opened file descriptor.
+ * @return number of exported pages or -1 on error
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_exportText(
         JNIEnv *env,
-        jobject this) {
+        jobject this,
+        jobject fileDescriptor,
+        jint first_page,
+        jint last_page,
+        jobject listener) {
     pdf_t *pdf = NULL;
-    jobject results = NULL;
-    pdf_page *page = NULL;
-    fz_text_span *text_span = NULL, *ln = NULL;
-    fz_device *dev = NULL;
-    char *textlinechars;
-    char *found = NULL;
-    fz_error error = 0;
-    jobject find_result = NULL;
-    int pageno = 0;
-    int pagecount;
-    int fd;
+    int fd = -1;
+    int result = 0;
+    export_progress_t progress;
+    fz_context *ctx = NULL;
 
-    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "export to txt");
+    fd = get_descriptor_from_file_descriptor(env, fileDescriptor);
+    if (fd < 0) return -1;
 
-    pdf = get_pdf_from_this(env, this);
-
-    pagecount = pdf_count_pages(pdf->xref);
+    ctx = get_thread_context();
+    if (ctx == NULL) return -1;
 
-    fd = open("/tmp/pdfview-export.txt", O_WRONLY|O_CREAT, 0666);
-    if (fd < 0) {
-         __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "Error opening /tmp/pdfview-export.txt");
-        return;
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return -1;
     }
 
-    for(pageno = 0; pageno < pagecount ; pageno++) {
-        page = get_page(pdf, pageno);
+    progress.env = env;
+    progress.listener = listener;
+    progress.method_id = apv_jni_ids.export_progress_listener_on_export_progress_method_id;
+
+    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "exporting text of pages %d..%d", (int)first_page, (int)last_page);
+    result = export_text(pdf, ctx, fd, first_page, last_page, export_text_progress, &progress);
+    release_pdf(pdf);
+    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "export complete: %d pages", result);
+
+    return result;
+}
 
-        if (pdf->last_pageno != pageno && NULL != pdf->xref->store) {
-            pdf_age_store(pdf->xref->store, TEXT_STORE_MAX_AGE);
-            pdf->last_pageno = pageno;
-        }
 
-      text_span = fz_new_text_span();
-      dev = fz_new_text_device(text_span);
-      error = pdf_run_page(pdf->xref, page, dev, fz_identity);
-      if (error)
-      {
-          /* TODO: cleanup */
-          fz_rethrow(error, "text extraction failed");
-          return;
-      }
-
-      /* TODO: Detect paragraph breaks using bbox field */
-      for(ln = text_span; ln; ln = ln->next) {
-          int i;
-          textlinechars = (char*)malloc(ln->len + 1);
-          for(i = 0; i < ln->len; ++i) textlinechars[i] = ln->text[i].c;
-          textlinechars[i] = '\n';
-          write(fd, textlinechars, ln->len+1);
-          free(textlinechars);
-      }
-
-      fz_free_device(dev);
-      fz_free_text_span(text_span);
+/**
+ * Implementation of native method PDF.prefetchPages.
+ * Interprets pages into display list cache, see prefetch_pages.
+ * @return number of pages that are ready for rendering
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_prefetchPages(
+        JNIEnv *env,
+        jobject this,
+        jintArray pages,
+        jboolean skipImages) {
+    pdf_t *pdf = NULL;
+    jint *jpages = NULL;
+    int count = 0;
+    int result = 0;
+    fz_context *ctx = NULL;
+
+    if (pages == NULL) return 0;
+
+    ctx = get_thread_context();
+    if (ctx == NULL) return 0;
+
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 0;
     }
 
-    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "export complete");
+    count = (*env)->GetArrayLength(env, pages);
+    jpages = (*env)->GetIntArrayElements(env, pages, NULL);
+    if (jpages != NULL) {
+        result = prefetch_pages(pdf, ctx, (const int*)jpages, count, skipImages);
+        (*env)->ReleaseIntArrayElements(env, pages, jpages, JNI_ABORT);
+    }
+    release_pdf(pdf);
 
-    close(fd);
+    return result;
 }
-#endif
 
 
 /* TODO: Specialcase searches for 7-bit text to make them faster */
@@ -454,7 +788,9 @@ Java_cx_hell_android_lib_pdf_PDF_find(
     jboolean is_copy;
     jobject results = NULL;
     fz_rect pagebox;
-    fz_page *page = NULL;
+    fz_rect page_bbox; /* page box in get_page_box sense, for converting coords */
+    fz_display_list *list = NULL;
+    fz_context *ctx = NULL;
     fz_text_sheet *text_sheet = NULL;
     fz_text_page *text_page = NULL;  /* contains text */
     fz_device *dev = NULL;
@@ -489,15 +825,44 @@ Java_cx_hell_android_lib_pdf_PDF_find(
     }
     ctext[needle_len] = 0; /* This will be needed if wcsstr() ever starts to work */
 
-    pdf = get_pdf_from_this(env, this);
+    ctx = get_thread_context();
+    pdf = acquire_pdf_from_this(env, this);
+    if (pdf) {
+        /* only interpretation needs document lock, text is extracted from display list */
+        list = get_page_display_list(pdf, pageno, 1, &pagebox, &page_bbox);
+        release_pdf(pdf);
+        pdf = NULL;
+    }
+    if (ctx == NULL || list == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to load page %d for search", (int)pageno);
+        free(ctext);
+        (*env)->ReleaseStringChars(env, text, jtext);
+        return NULL;
+    }
 
-    page = fz_load_page(pdf->doc, pageno);
-    text_sheet = fz_new_text_sheet(pdf->ctx);
-    text_page = fz_new_text_page(pdf->ctx, fz_bound_page(pdf->doc, page, &pagebox));
-    dev = fz_new_text_device(pdf->ctx, text_sheet, text_page);
-    fz_run_page(pdf->doc, page, dev, &fz_identity, &cookie);
-    fz_free_device(dev);
-    dev = NULL;
+    fz_var(text_sheet);
+    fz_var(text_page);
+    fz_var(dev);
+    fz_var(list);
+
+    fz_try(ctx) {
+        text_sheet = fz_new_text_sheet(ctx);
+        text_page = fz_new_text_page(ctx, &pagebox);
+        dev = fz_new_text_device(ctx, text_sheet, text_page);
+        fz_run_display_list(list, dev, &fz_identity, NULL, &cookie);
+    } fz_always(ctx) {
+        if (dev) fz_free_device(dev);
+        dev = NULL;
+        fz_free_display_list(ctx, list);
+        list = NULL;
+    } fz_catch(ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to extract text of page %d", (int)pageno);
+        if (text_page) fz_free_text_page(ctx, text_page);
+        if (text_sheet) fz_free_text_sheet(ctx, text_sheet);
+        free(ctext);
+        (*env)->ReleaseStringChars(env, text, jtext);
+        return NULL;
+    }
 
     #ifndef NDEBUG
     APV_LOG_PRINT(APV_LOG_DEBUG, "%d blocks on page on page %d", text_page->len, pageno);
@@ -554,7 +919,7 @@ Java_cx_hell_android_lib_pdf_PDF_find(
                 // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "copying chars from %d to %d", i0, i1);
                 for(i = i0; i < i1; ++i) {
                     charbox = textlineboxes[i];
-                    convert_box_pdf_to_apv(pdf, pageno, rotation, &charbox);
+                    convert_box_to_apv(&page_bbox, rotation, &charbox);
                     add_find_result_marker(env, find_result,
                             charbox.x0, charbox.y0,
                             charbox.x1, charbox.y1);
@@ -572,17 +937,13 @@ Java_cx_hell_android_lib_pdf_PDF_find(
         }
     }
 
-    if (page) {
-        page = NULL;
-    }
-
     if (text_sheet) {
-        fz_free_text_sheet(pdf->ctx, text_sheet);
+        fz_free_text_sheet(ctx, text_sheet);
         text_sheet = NULL;
     }
 
     if (text_page) {
-        fz_free_text_page(pdf->ctx, text_page);
+        fz_free_text_page(ctx, text_page);
         text_page = NULL;
     }
 
@@ -593,72 +954,17 @@ Java_cx_hell_android_lib_pdf_PDF_find(
 }
 
 
-
-
-// #ifdef pro
-// /**
-//  * Return text of given page.
-//  */
-// JNIEXPORT jobject JNICALL
-// Java_cx_hell_android_lib_pdf_PDF_getText(
-//         JNIEnv *env,
-//         jobject this,
-//         jint pageno) {
-//     char *text = NULL;
-//     pdf_t *pdf = NULL;
-//     pdf = get_pdf_from_this(env, this);
-//     jstring jtext = NULL;
-// 
-//     if (pdf == NULL) {
-//         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "getText: pdf is NULL");
-//         return NULL;
-//     }
-//     text = extract_text(pdf, pageno);
-//     jtext = (*env)->NewStringUTF(env, text);
-//     if (text) free(text);
-//     return jtext;
-// }
-// #endif
-
-
 /**
  * Create empty FindResult object.
  * @param env JNI Environment
  * @return newly created, empty FindResult object
  */
 jobject create_find_result(JNIEnv *env) {
-    static jmethodID constructorID;
-    jclass findResultClass = NULL;
-    static int jni_ids_cached = 0;
-    jobject findResultObject = NULL;
-
-    findResultClass = (*env)->FindClass(env, "cx/hell/android/lib/pagesview/FindResult");
-
-    if (findResultClass == NULL) {
-        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "create_find_result: FindClass returned NULL");
-        return NULL;
-    }
-
-    if (jni_ids_cached == 0) {
-        constructorID = (*env)->GetMethodID(env, findResultClass, "<init>", "()V");
-        if (constructorID == NULL) {
-            (*env)->DeleteLocalRef(env, findResultClass);
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "create_find_result: couldn't get method id for FindResult constructor");
-            return NULL;
-        }
-        jni_ids_cached = 1;
-    }
-
-    findResultObject = (*env)->NewObject(env, findResultClass, constructorID);
-    (*env)->DeleteLocalRef(env, findResultClass);
-    return findResultObject;
+    return (*env)->NewObject(env, apv_jni_ids.find_result_class, apv_jni_ids.find_result_constructor_id);
 }
 
 
 void add_find_result_to_list(JNIEnv *env, jobject *list, jobject find_result) {
-    static int jni_ids_cached = 0;
-    static jmethodID list_add_method_id = NULL;
-    jclass list_class = NULL;
     if (list == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "list cannot be null - it must be a pointer jobject variable");
         return;
@@ -668,43 +974,16 @@ void add_find_result_to_list(JNIEnv *env, jobject *list, jobject find_result) {
         return;
     }
     if (*list == NULL) {
-        jmethodID list_constructor_id;
         // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "creating ArrayList");
-        list_class = (*env)->FindClass(env, "java/util/ArrayList");
-        if (list_class == NULL) {
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find class java/util/ArrayList");
-            return;
-        }
-        list_constructor_id = (*env)->GetMethodID(env, list_class, "<init>", "()V");
-        if (!list_constructor_id) {
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find ArrayList constructor");
-            return;
-        }
-        *list = (*env)->NewObject(env, list_class, list_constructor_id);
+        *list = (*env)->NewObject(env, apv_jni_ids.array_list_class, apv_jni_ids.array_list_constructor_id);
         if (*list == NULL) {
             __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to create ArrayList: NewObject returned NULL");
             return;
         }
     }
 
-    if (!jni_ids_cached) {
-        if (list_class == NULL) {
-            list_class = (*env)->FindClass(env, "java/util/ArrayList");
-            if (list_class == NULL) {
-                __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find class java/util/ArrayList");
-                return;
-            }
-        }
-        list_add_method_id = (*env)->GetMethodID(env, list_class, "add", "(Ljava/lang/Object;)Z");
-        if (list_add_method_id == NULL) {
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't get ArrayList.add method id");
-            return;
-        }
-        jni_ids_cached = 1;
-    } 
-
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "calling ArrayList.add");
-    (*env)->CallBooleanMethod(env, *list, list_add_method_id, find_result);
+    (*env)->CallBooleanMethod(env, *list, apv_jni_ids.array_list_add_method_id, find_result);
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "add_find_result_to_list done");
 }
 
@@ -716,16 +995,7 @@ void add_find_result_to_list(JNIEnv *env, jobject *list, jobject find_result) {
  * @param page new value for page field
  */
 void set_find_result_page(JNIEnv *env, jobject findResult, int page) {
-    static char jni_ids_cached = 0;
-    static jfieldID page_field_id = 0;
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "trying to set find results page number");
-    if (jni_ids_cached == 0) {
-        jclass findResultClass = (*env)->GetObjectClass(env, findResult);
-        page_field_id = (*env)->GetFieldID(env, findResultClass, "page", "I");
-        jni_ids_cached = 1;
-    }
-    (*env)->SetIntField(env, findResult, page_field_id, page);
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "find result page number set");
+    (*env)->SetIntField(env, findResult, apv_jni_ids.find_result_page_field_id, page);
 }
 
 
@@ -733,108 +1003,77 @@ void set_find_result_page(JNIEnv *env, jobject findResult, int page) {
  * Add marker to find result.
  */
 void add_find_result_marker(JNIEnv *env, jobject findResult, int x0, int y0, int x1, int y1) {
-    static jmethodID addMarker_methodID = 0;
-    static unsigned char jni_ids_cached = 0;
-    if (!jni_ids_cached) {
-        jclass findResultClass = NULL;
-        findResultClass = (*env)->FindClass(env, "cx/hell/android/lib/pagesview/FindResult");
-        if (findResultClass == NULL) {
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "add_find_result_marker: FindClass returned NULL");
-            return;
-        }
-        addMarker_methodID = (*env)->GetMethodID(env, findResultClass, "addMarker", "(IIII)V");
-        if (addMarker_methodID == NULL) {
-            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "add_find_result_marker: couldn't find FindResult.addMarker method ID");
-            return;
-        }
-        jni_ids_cached = 1;
-    }
-    (*env)->CallVoidMethod(env, findResult, addMarker_methodID, x0, y0, x1, y1); /* TODO: is always really int jint? */
+    (*env)->CallVoidMethod(env, findResult, apv_jni_ids.find_result_add_marker_method_id, x0, y0, x1, y1); /* TODO: is always really int jint? */
 }
 
 
 /**
- * Get pdf_ptr field value, cache field address as a static field.
+ * Get pdf_ptr field value.
  * @param env Java JNI Environment
  * @param this object to get "pdf_ptr" field from
  * @return pdf_ptr field value
  */
 pdf_t* get_pdf_from_this(JNIEnv *env, jobject this) {
-    static jfieldID field_id = 0;
-    static unsigned char field_is_cached = 0;
+    return (pdf_t*) (*env)->GetIntField(env, this, apv_jni_ids.pdf_ptr_field_id);
+}
+
+
+/**
+ * Get pdf_ptr field value and lock it for use.
+ * Returned pdf_t is not freed until release_pdf is called, but it can be used
+ * by other threads at the same time (see pdf_t docs).
+ * @return pdf_ptr field value, NULL if there's no document
+ */
+pdf_t* acquire_pdf_from_this(JNIEnv *env, jobject this) {
     pdf_t *pdf = NULL;
-    if (!field_is_cached) {
-        jclass this_class = (*env)->GetObjectClass(env, this);
-        field_id = (*env)->GetFieldID(env, this_class, "pdf_ptr", "I");
-        field_is_cached = 1;
-        __android_log_print(ANDROID_LOG_DEBUG, "cx.hell.android.pdfview", "cached pdf_ptr field id %d", (int)field_id);
-    }
-	pdf = (pdf_t*) (*env)->GetIntField(env, this, field_id);
+    pthread_mutex_lock(&pdf_ptr_lock);
+    pdf = get_pdf_from_this(env, this);
+    if (pdf) pthread_rwlock_rdlock(&pdf->users_lock);
+    pthread_mutex_unlock(&pdf_ptr_lock);
     return pdf;
 }
 
 
 /**
- * Get descriptor field value from FileDescriptor class, cache field offset.
+ * Release pdf_t acquired by acquire_pdf_from_this.
+ */
+void release_pdf(pdf_t *pdf) {
+    if (pdf) pthread_rwlock_unlock(&pdf->users_lock);
+}
+
+
+/**
+ * Get descriptor field value from FileDescriptor class.
  * This is undocumented private field.
  * @param env JNI Environment
  * @param this FileDescriptor object
  * @return file descriptor field value
  */
 int get_descriptor_from_file_descriptor(JNIEnv *env, jobject this) {
-    static jfieldID field_id = 0;
-    static unsigned char is_cached = 0;
     if (!this) {
         APV_LOG_PRINT(APV_LOG_WARN, "can't get file descriptor from null");
         return -1;
     }
-    if (!is_cached) {
-        jclass this_class = (*env)->GetObjectClass(env, this);
-        field_id = (*env)->GetFieldID(env, this_class, "descriptor", "I");
-        is_cached = 1;
-        __android_log_print(ANDROID_LOG_DEBUG, "cx.hell.android.pdfview", "cached descriptor field id %d", (int)field_id);
-    }
-    // __android_log_print(ANDROID_LOG_DEBUG, "cx.hell.android.pdfview", "will get descriptor field...");
-    return (*env)->GetIntField(env, this, field_id);
+    return (*env)->GetIntField(env, this, apv_jni_ids.file_descriptor_descriptor_field_id);
 }
 
 
 void get_size(JNIEnv *env, jobject size, int *width, int *height) {
-    static jfieldID width_field_id = 0;
-    static jfieldID height_field_id = 0;
-    static unsigned char fields_are_cached = 0;
-    if (! fields_are_cached) {
-        jclass size_class = (*env)->GetObjectClass(env, size);
-        width_field_id = (*env)->GetFieldID(env, size_class, "width", "I");
-        height_field_id = (*env)->GetFieldID(env, size_class, "height", "I");
-        fields_are_cached = 1;
-        __android_log_print(ANDROID_LOG_DEBUG, "cx.hell.android.pdfview", "cached Size fields");
-    }
-    *width = (*env)->GetIntField(env, size, width_field_id);
-    *height = (*env)->GetIntField(env, size, height_field_id);
+    *width = (*env)->GetIntField(env, size, apv_jni_ids.size_width_field_id);
+    *height = (*env)->GetIntField(env, size, apv_jni_ids.size_height_field_id);
 }
 
 
 /**
- * Store width and height values into PDF.Size object, cache field ids in static members.
+ * Store width and height values into PDF.Size object.
  * @param env JNI Environment
  * @param width width to store
  * @param height height field value to be stored
  * @param size target PDF.Size object
  */
 void save_size(JNIEnv *env, jobject size, int width, int height) {
-    static jfieldID width_field_id = 0;
-    static jfieldID height_field_id = 0;
-    static unsigned char fields_are_cached = 0;
-    if (! fields_are_cached) {
-        jclass size_class = (*env)->GetObjectClass(env, size);
-        width_field_id = (*env)->GetFieldID(env, size_class, "width", "I");
-        height_field_id = (*env)->GetFieldID(env, size_class, "height", "I");
-        fields_are_cached = 1;
-        __android_log_print(ANDROID_LOG_DEBUG, "cx.hell.android.pdfview", "cached Size fields");
-    }
-    (*env)->SetIntField(env, size, width_field_id, width);
-    (*env)->SetIntField(env, size, height_field_id, height);
+    (*env)->SetIntField(env, size, apv_jni_ids.size_width_field_id, width);
+    (*env)->SetIntField(env, size, apv_jni_ids.size_height_field_id, height);
 }
 
 
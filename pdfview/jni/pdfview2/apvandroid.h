@@ -18,6 +18,9 @@
 
 
 pdf_t* get_pdf_from_this(JNIEnv *env, jobject this);
+pdf_t* acquire_pdf_from_this(JNIEnv *env, jobject this);
+void release_pdf(pdf_t *pdf);
+fz_context *get_thread_context();
 void get_size(JNIEnv *env, jobject size, int *width, int *height);
 void save_size(JNIEnv *env, jobject size, int width, int height);
 void pdf_android_loghandler(const char *m);
@@ -26,11 +29,11 @@ void set_find_result_page(JNIEnv *env, jobject findResult, int page);
 void add_find_result_marker(JNIEnv *env, jobject findResult, int x0, int y0, int x1, int y1);
 void add_find_result_to_list(JNIEnv *env, jobject *list, jobject find_result);
 int find_next(JNIEnv *env, jobject this, int direction);
+int export_text_progress(void *user, int pages_done, int pages_total);
 
 
 // #ifdef pro
 // jobject create_outline_recursive(JNIEnv *env, jclass outline_class, const fz_outline *outline);
-// char* extract_text(pdf_t *pdf, int pageno);
 // #endif
 
 
@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "apvcore.h"
+
+#include "mupdf-internal.h"
+
+
+/*
+ * Sidecar cache of resolved xref and page info.
+ *
+ * When pdf_t is freed, its xref table, trailer, page object numbers and page
+ * sizes are written to a file in cache dir named after fingerprint of the
+ * document, so cache is found also after the file is moved or copied. Next
+ * time the same file is opened, xref is loaded from that file instead of
+ * reading all xref sections (or repairing a damaged file), and page count,
+ * page lookups and page sizes come from cached page info until something
+ * needs the page tree.
+ *
+ * Cache is used only if size and fingerprint of the document match. If
+ * trailer of the document can be read, it must also be equal to cached one
+ * (for repaired documents only /ID is compared, since their trailer is
+ * reconstructed).
+ * Layout is native, cache is never shared between devices.
+ *
+ * Cache dir is kept under CACHE_MAX_FILES files and CACHE_MAX_DIR_SIZE bytes:
+ * after each save, least recently used cache files are removed first (cache
+ * file's mtime is refreshed whenever it's read).
+ */
+
+
+#define CACHE_MAGIC 0x58565041 /* "APVX" */
+#define CACHE_VERSION 2
+
+/* sanity limits for values read from cache file */
+#define CACHE_MAX_XREF_LEN (8 * 1024 * 1024)
+#define CACHE_MAX_TRAILER_LEN (1024 * 1024)
+#define CACHE_MAX_PAGE_COUNT (8 * 1024 * 1024)
+
+/* limits of cache dir, oldest cache files are removed when exceeded */
+#define CACHE_MAX_FILES 200
+#define CACHE_MAX_DIR_SIZE (32 * 1024 * 1024)
+#define CACHE_FILE_SUFFIX ".apvx"
+
+
+typedef struct {
+    int magic;
+    int version;
+    long long size;
+    unsigned long long fingerprint;
+    int repaired;
+    int xref_len;
+    int trailer_len;
+    int page_count; /* 0 if page info is not stored */
+    char pages_box[MAX_BOX_NAME + 1];
+} cache_header_t;
+
+
+typedef struct {
+    int type;
+    int ofs;
+    int gen;
+    int stm_ofs;
+} cache_xref_entry_t;
+
+
+typedef struct {
+    cache_header_t header;
+    cache_xref_entry_t *entries;
+    char *trailer;
+    apv_page_info_t *pages;
+    int used; /* set by loader when xref was loaded from cache */
+} cache_t;
+
+
+static pthread_mutex_t cache_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cache_dir[PATH_MAX] = "";
+
+
+/**
+ * Set directory for sidecar cache files; NULL or empty disables cache.
+ */
+void apv_set_cache_dir(const char *dir) {
+    pthread_mutex_lock(&cache_dir_lock);
+    if (dir && strlen(dir) < sizeof(cache_dir)) {
+        strcpy(cache_dir, dir);
+    } else {
+        cache_dir[0] = 0;
+    }
+    pthread_mutex_unlock(&cache_dir_lock);
+}
+
+
+/**
+ * Get size of document file by name or, if filename is NULL, by fd.
+ * Fingerprint is filled in by apv_get_fingerprint once file is opened.
+ * @return 1 if file is a regular file and file_id can be used
+ */
+int apv_get_file_id(const char *filename, int fd, apv_file_id_t *file_id) {
+    struct stat st;
+    int r = filename ? stat(filename, &st) : fstat(fd, &st);
+    file_id->valid = 0;
+    if (r != 0 || !S_ISREG(st.st_mode)) return 0;
+    file_id->size = st.st_size;
+    file_id->fingerprint = 0;
+    file_id->valid = 1;
+    return 1;
+}
+
+
+/**
+ * Create temporary file in cache dir. File is unlinked right away, so it's
+ * removed when descriptor is closed.
+ * @return descriptor or -1 if cache dir is not set or file can't be created
+ */
+int apv_create_temp_file() {
+    char path[PATH_MAX];
+    int n = 0;
+    int fd = -1;
+    pthread_mutex_lock(&cache_dir_lock);
+    if (cache_dir[0]) {
+        n = snprintf(path, sizeof(path), "%s/spill-XXXXXX", cache_dir);
+    }
+    pthread_mutex_unlock(&cache_dir_lock);
+    if (n <= 0 || (size_t)n >= sizeof(path)) return -1;
+    fd = mkstemp(path);
+    if (fd == -1) {
+        APV_LOG_PRINT(APV_LOG_WARN, "can't create %s: %s", path, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+
+/**
+ * Build cache file path for document.
+ * @return 1 if cache is enabled and path fits
+ */
+static int get_cache_path(const apv_file_id_t *file_id, char *path, size_t size) {
+    int n = 0;
+    if (!file_id->valid) return 0;
+    pthread_mutex_lock(&cache_dir_lock);
+    if (cache_dir[0]) {
+        n = snprintf(path, size, "%s/%016llx" CACHE_FILE_SUFFIX, cache_dir, file_id->fingerprint);
+    }
+    pthread_mutex_unlock(&cache_dir_lock);
+    return n > 0 && (size_t)n < size;
+}
+
+
+static void free_cache(cache_t *cache) {
+    if (cache == NULL) return;
+    free(cache->entries);
+    free(cache->trailer);
+    free(cache->pages);
+    free(cache);
+}
+
+
+/**
+ * Read cache file of document.
+ * @return cache or NULL if there's no valid cache for this file
+ */
+static cache_t *read_cache(pdf_t *pdf) {
+    char path[PATH_MAX];
+    FILE *f = NULL;
+    cache_t *cache = NULL;
+    cache_header_t *h = NULL;
+    int i = 0;
+    int ok = 0;
+
+    if (!get_cache_path(&pdf->file_id, path, sizeof(path))) return NULL;
+    f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+
+    cache = calloc(1, sizeof(cache_t));
+    if (cache == NULL) goto out;
+    h = &cache->header;
+    if (fread(h, sizeof(cache_header_t), 1, f) != 1) goto out;
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION
+            || h->size != pdf->file_id.size || h->fingerprint != pdf->file_id.fingerprint) {
+        APV_LOG_PRINT(APV_LOG_DEBUG, "cache %s is stale", path);
+        goto out;
+    }
+    if (h->xref_len <= 0 || h->xref_len > CACHE_MAX_XREF_LEN
+            || h->trailer_len <= 0 || h->trailer_len > CACHE_MAX_TRAILER_LEN
+            || h->page_count < 0 || h->page_count > CACHE_MAX_PAGE_COUNT) goto out;
+    h->pages_box[MAX_BOX_NAME] = 0;
+
+    cache->entries = malloc(h->xref_len * sizeof(cache_xref_entry_t));
+    cache->trailer = malloc(h->trailer_len);
+    if (cache->entries == NULL || cache->trailer == NULL) goto out;
+    if (fread(cache->entries, sizeof(cache_xref_entry_t), h->xref_len, f) != (size_t)h->xref_len) goto out;
+    if (fread(cache->trailer, 1, h->trailer_len, f) != (size_t)h->trailer_len) goto out;
+    if (h->page_count > 0) {
+        cache->pages = malloc(h->page_count * sizeof(apv_page_info_t));
+        if (cache->pages == NULL) goto out;
+        if (fread(cache->pages, sizeof(apv_page_info_t), h->page_count, f) != (size_t)h->page_count) goto out;
+        for(i = 0; i < h->page_count; ++i) {
+            if (cache->pages[i].num < 0 || cache->pages[i].num >= h->xref_len) goto out;
+        }
+    }
+    /* 0 is what mupdf leaves for numbers missing in file's xref */
+    for(i = 0; i < h->xref_len; ++i) {
+        int type = cache->entries[i].type;
+        if (type != 'n' && type != 'o' && type != 'f' && type != 0) {
+            APV_LOG_PRINT(APV_LOG_WARN, "cache %s has invalid xref entry %d type %d", path, i, type);
+            goto out;
+        }
+    }
+    ok = 1;
+    /* mark as recently used for prune_cache_dir */
+    utimes(path, NULL);
+
+out:
+    fclose(f);
+    if (!ok) {
+        free_cache(cache);
+        cache = NULL;
+    }
+    return cache;
+}
+
+
+/**
+ * Xref loader that fills xref table and trailer from cache.
+ * Throws if cache doesn't match the document.
+ */
+static void load_cached_xref(pdf_document *xref, pdf_obj *file_trailer, void *arg) {
+    cache_t *cache = (cache_t*)arg;
+    fz_context *ctx = xref->ctx;
+    fz_stream *stm = NULL;
+    pdf_obj *trailer = NULL;
+    pdf_obj *file_id = NULL;
+    int i = 0;
+
+    fz_var(stm);
+    fz_var(trailer);
+
+    fz_try(ctx) {
+        stm = fz_open_memory(ctx, (unsigned char*)cache->trailer, cache->header.trailer_len);
+        trailer = pdf_parse_stm_obj(xref, stm, &xref->lexbuf.base);
+        if (!pdf_is_dict(trailer))
+            fz_throw(ctx, "cached trailer is not a dictionary");
+        if (file_trailer) {
+            file_id = pdf_dict_gets(file_trailer, "ID");
+            if (!cache->header.repaired && pdf_objcmp(file_trailer, trailer))
+                fz_throw(ctx, "cached trailer does not match file");
+            if (cache->header.repaired && file_id && pdf_objcmp(file_id, pdf_dict_gets(trailer, "ID")))
+                fz_throw(ctx, "cached document ID does not match file");
+        }
+
+        /* from the last entry, so table is resized once */
+        for(i = cache->header.xref_len - 1; i >= 0; --i) {
+            pdf_xref_entry *entry = pdf_get_xref_entry(xref, i);
+            entry->type = (char)cache->entries[i].type;
+            entry->ofs = cache->entries[i].ofs;
+            entry->gen = cache->entries[i].gen;
+            entry->stm_ofs = cache->entries[i].stm_ofs;
+        }
+        pdf_set_xref_trailer(xref, trailer);
+    } fz_always(ctx) {
+        fz_close(stm);
+        pdf_drop_obj(trailer);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    xref->repaired = cache->header.repaired;
+    cache->used = 1;
+}
+
+
+/**
+ * Open document, using sidecar cache if there's a valid one.
+ * Sets pdf->pages from cache and pdf->cache_dirty if cache should be written.
+ * Throws like pdf_open_document_with_stream.
+ */
+fz_document *apv_open_cached_document(pdf_t *pdf, fz_stream *stream) {
+    pdf_document *doc = NULL;
+    cache_t *cache = NULL;
+
+    cache = read_cache(pdf);
+    if (cache == NULL) {
+        pdf->cache_dirty = pdf->file_id.valid;
+        pdf->doc = (fz_document*)pdf_open_document_with_stream(pdf->ctx, stream);
+        /* repair is slow, don't lose its result if app is killed before pdf is freed */
+        if (pdf->cache_dirty && ((pdf_document*)pdf->doc)->repaired) {
+            apv_save_cache(pdf);
+            pdf->cache_dirty = 1;
+        }
+        return pdf->doc;
+    }
+
+    fz_try(pdf->ctx) {
+        doc = pdf_open_document_with_xref_loader(pdf->ctx, stream, load_cached_xref, cache);
+    } fz_catch(pdf->ctx) {
+        free_cache(cache);
+        fz_rethrow(pdf->ctx);
+    }
+
+    if (cache->used) {
+        APV_LOG_PRINT(APV_LOG_DEBUG, "loaded xref (%d entries) and %d pages from cache", cache->header.xref_len, cache->header.page_count);
+        if (cache->pages) {
+            pdf->pages = cache->pages;
+            pdf->page_count = cache->header.page_count;
+            strcpy(pdf->pages_box, cache->header.pages_box);
+            cache->pages = NULL;
+        } else {
+            pdf->cache_dirty = 1;
+        }
+    } else {
+        pdf->cache_dirty = 1;
+    }
+    free_cache(cache);
+    return (fz_document*)doc;
+}
+
+
+/**
+ * Write page info. Object numbers come from page tree if it was loaded,
+ * otherwise pages that were not looked up yet are written with number 0.
+ * @return page count written, 0 on error
+ */
+static int write_pages(pdf_t *pdf, FILE *f) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    apv_page_info_t info;
+    int count = 0;
+    int i = 0;
+    int sizes = 0;
+
+    if (is_page_tree_loaded(pdf)) {
+        count = xref->page_len;
+        sizes = pdf->pages && pdf->page_count == count;
+        for(i = 0; i < count; ++i) {
+            info.num = pdf_to_num(xref->page_refs[i]);
+            info.width = sizes ? pdf->pages[i].width : -1;
+            info.height = sizes ? pdf->pages[i].height : -1;
+            if (fwrite(&info, sizeof(info), 1, f) != 1) return 0;
+        }
+        return count;
+    }
+    if (pdf->pages == NULL) return 0;
+    if (fwrite(pdf->pages, sizeof(apv_page_info_t), pdf->page_count, f) != (size_t)pdf->page_count) return 0;
+    return pdf->page_count;
+}
+
+
+typedef struct {
+    char name[32];
+    time_t mtime;
+    long long size;
+} cache_file_t;
+
+
+static int compare_cache_files(const void *a, const void *b) {
+    const cache_file_t *fa = (const cache_file_t*)a;
+    const cache_file_t *fb = (const cache_file_t*)b;
+    if (fa->mtime != fb->mtime) return fa->mtime < fb->mtime ? -1 : 1;
+    return strcmp(fa->name, fb->name);
+}
+
+
+/**
+ * Remove least recently used cache files until cache dir is within
+ * CACHE_MAX_FILES and CACHE_MAX_DIR_SIZE. The newest file is always kept.
+ */
+static void prune_cache_dir() {
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    struct stat st;
+    cache_file_t *files = NULL;
+    int count = 0;
+    int capacity = 0;
+    long long total = 0;
+    size_t suffix_len = strlen(CACHE_FILE_SUFFIX);
+    int i = 0;
+
+    pthread_mutex_lock(&cache_dir_lock);
+    strcpy(dir, cache_dir);
+    pthread_mutex_unlock(&cache_dir_lock);
+    if (!dir[0]) return;
+
+    d = opendir(dir);
+    if (d == NULL) return;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= suffix_len || len >= sizeof(files->name)
+                || strcmp(de->d_name + len - suffix_len, CACHE_FILE_SUFFIX) != 0) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            cache_file_t *new_files = realloc(files, new_capacity * sizeof(cache_file_t));
+            if (new_files == NULL) break;
+            files = new_files;
+            capacity = new_capacity;
+        }
+        strcpy(files[count].name, de->d_name);
+        files[count].mtime = st.st_mtime;
+        files[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if (count > CACHE_MAX_FILES || total > CACHE_MAX_DIR_SIZE) {
+        qsort(files, count, sizeof(cache_file_t), compare_cache_files);
+        for(i = 0; i < count - 1 && (count - i > CACHE_MAX_FILES || total > CACHE_MAX_DIR_SIZE); ++i) {
+            snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+            if (unlink(path) != 0 && errno != ENOENT) {
+                APV_LOG_PRINT(APV_LOG_WARN, "can't remove %s: %s", path, strerror(errno));
+            }
+            total -= files[i].size;
+        }
+        APV_LOG_PRINT(APV_LOG_DEBUG, "pruned %d of %d cache files", i, count);
+    }
+    free(files);
+}
+
+
+/**
+ * Write sidecar cache of pdf.
+ * File is written under temporary name and renamed, so readers never see
+ * partially written cache. Then old cache files over cache dir limits are
+ * removed.
+ * Caller must have exclusive access to pdf.
+ */
+void apv_save_cache(pdf_t *pdf) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    cache_header_t header;
+    cache_xref_entry_t entry;
+    FILE *f = NULL;
+    long trailer_start = 0;
+    int i = 0;
+    int ok = 1;
+
+    if (!get_cache_path(&pdf->file_id, path, sizeof(path))) return;
+    if (pdf_trailer(xref) == NULL || pdf_xref_len(xref) == 0) return;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) return;
+
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        APV_LOG_PRINT(APV_LOG_WARN, "can't create %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.size = pdf->file_id.size;
+    header.fingerprint = pdf->file_id.fingerprint;
+    header.repaired = xref->repaired;
+    header.xref_len = pdf_xref_len(xref);
+    strcpy(header.pages_box, pdf->pages_box);
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for(i = 0; ok && i < header.xref_len; ++i) {
+        pdf_xref_entry *e = pdf_get_xref_entry(xref, i);
+        entry.type = e->type;
+        entry.ofs = e->ofs;
+        entry.gen = e->gen;
+        entry.stm_ofs = e->stm_ofs;
+        ok = fwrite(&entry, sizeof(entry), 1, f) == 1;
+    }
+
+    if (ok) {
+        trailer_start = ftell(f);
+        fz_try(pdf->ctx) {
+            pdf_fprint_obj(f, pdf_trailer(xref), 1);
+        } fz_catch(pdf->ctx) {
+            ok = 0;
+        }
+        header.trailer_len = ftell(f) - trailer_start;
+    }
+
+    if (ok) {
+        header.page_count = write_pages(pdf, f);
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    }
+
+    if (ferror(f)) ok = 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        APV_LOG_PRINT(APV_LOG_WARN, "failed to write cache %s", path);
+        unlink(tmp_path);
+        return;
+    }
+    pdf->cache_dirty = 0;
+    APV_LOG_PRINT(APV_LOG_DEBUG, "saved cache %s: %d xref entries, %d pages", path, header.xref_len, header.page_count);
+
+    prune_cache_dir();
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
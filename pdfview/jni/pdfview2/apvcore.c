@@ -2,6 +2,9 @@
 #define _GNU_SOURCE
 #include <string.h>
 #include <wctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "apvcore.h"
 
@@ -80,7 +83,8 @@ void *apv_malloc(void *user, unsigned int size) {
         }
         header = buf;
         header->size = size;
-        state->current_size += size;
+        /* atomic: fitz allocates contexts without holding FZ_LOCK_ALLOC */
+        __sync_add_and_fetch(&state->current_size, size);
 #ifndef NDEBUG
         header->magic = state->magic;
         if (state->current_size > state->peak_size) {
@@ -120,19 +124,20 @@ void *apv_realloc(void *user, void *old, unsigned int size) {
         if (state->max_size > 0) {
             if (change > 0) {
                 if (state->current_size + change > state->max_size) {
-                    /* too much, simulate fail */
+                    /* too much, simulate fail; old block must stay valid, fitz scavenges store and retries with it */
                     APV_LOG_PRINT(APV_LOG_WARN, "refusing to reallocate %d to %d, current_size: %d, max_size: %d", header->size, size, state->current_size, state->max_size);
-                    state->current_size -= header->size;
-                    free(buf);
                     return NULL;
                 }
             }
         }
         /* didn't exceed, do realloc */
         buf = realloc(buf, size + sizeof(apv_alloc_header_t));
+        if (buf == NULL) {
+            return NULL;
+        }
         header = buf; /* possibly moved by realloc */
         header->size = size;
-        state->current_size += change;
+        __sync_add_and_fetch(&state->current_size, change);
 #ifndef NDEBUG
         if (state->current_size > state->peak_size) {
             state->peak_size = state->current_size;
@@ -159,12 +164,45 @@ void apv_free(void *user, void *ptr) {
             abort();
         }
         // fprintf(stderr, "aptn_free: ptr: %p, info: %p, size to free: %u, current size: %u\n", ptr, info, info->size, conf->current_size);
-        state->current_size -= header->size;
+        __sync_sub_and_fetch(&state->current_size, header->size);
         free(buf);
     }
 }
 
 
+static void apv_lock(void *user, int lock) {
+    pthread_mutex_t *mutexes = user;
+    pthread_mutex_lock(&mutexes[lock]);
+}
+
+
+static void apv_unlock(void *user, int lock) {
+    pthread_mutex_t *mutexes = user;
+    pthread_mutex_unlock(&mutexes[lock]);
+}
+
+
+/**
+ * Create fitz locks backed by pthread mutexes.
+ * Fitz context must be created with locks so that it can be cloned for use in
+ * other threads.
+ */
+fz_locks_context *apv_new_locks_context() {
+    int i = 0;
+    fz_locks_context *locks = NULL;
+    pthread_mutex_t *mutexes = NULL;
+    locks = malloc(sizeof(fz_locks_context));
+    mutexes = malloc(FZ_LOCK_MAX * sizeof(pthread_mutex_t));
+    for(i = 0; i < FZ_LOCK_MAX; ++i) {
+        pthread_mutex_init(&mutexes[i], NULL);
+    }
+    locks->user = mutexes;
+    locks->lock = apv_lock;
+    locks->unlock = apv_unlock;
+    return locks;
+}
+
+
 const char boxes[NUM_BOXES][MAX_BOX_NAME+1] = {
     "ArtBox",
     "BleedBox",
@@ -206,12 +244,25 @@ wchar_t* widestrstr(wchar_t* haystack, int haystack_length, wchar_t* needle, int
 }
 
 
+static void apv_lock_doc(void *user) {
+    pdf_t *pdf = user;
+    pthread_mutex_lock(&pdf->doc_lock);
+}
+
+
+static void apv_unlock_doc(void *user) {
+    pdf_t *pdf = user;
+    pthread_mutex_unlock(&pdf->doc_lock);
+}
+
+
 /**
  * pdf_t "constructor": create empty pdf_t with default values.
  * @return newly allocated pdf_t struct with fields set to default values
  */
 pdf_t* create_pdf_t(fz_context *context, fz_alloc_context *alloc_context, apv_alloc_state_t *alloc_state) {
     pdf_t *pdf = NULL;
+    pthread_mutexattr_t doc_lock_attr;
     
 #ifndef NDEBUG
     /* simple assert based on apv_alloc_state->magic */
@@ -225,12 +276,38 @@ pdf_t* create_pdf_t(fz_context *context, fz_alloc_context *alloc_context, apv_al
 
     pdf = malloc(sizeof(pdf_t));
 
-    pdf->ctx = context;
+    /* doc->ctx is pdf->ctx, so documents used from different threads must not share context */
+    pdf->ctx = fz_clone_context(context);
+    if (pdf->ctx == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to clone fitz context");
+        free(pdf);
+        return NULL;
+    }
+    /* recursive: Type3 fonts lock it again when used while page is interpreted */
+    pthread_mutexattr_init(&doc_lock_attr);
+    pthread_mutexattr_settype(&doc_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pdf->doc_lock, &doc_lock_attr);
+    pthread_mutexattr_destroy(&doc_lock_attr);
+    pthread_rwlock_init(&pdf->users_lock, NULL);
+    pthread_mutex_init(&pdf->lists_lock, NULL);
+    memset(pdf->page_lists, 0, sizeof(pdf->page_lists));
+    pdf->page_list_clock = 0;
     pdf->alloc_context = alloc_context;
     pdf->alloc_state = alloc_state;
     pdf->doc = NULL;
     pdf->fileno = -1;
     pdf->invalid_password = 0;
+    pdf->linearized = 0;
+    pdf->page_count = 0;
+    pdf->pages = NULL;
+    pdf->page_nodes = NULL;
+    pdf->page_node_count = 0;
+    pdf->page_node_cap = 0;
+    pdf->last_page_node = -1;
+    pdf->pages_box[0] = 0;
+    pdf->file_id.valid = 0;
+    pdf->cache_dirty = 0;
+    memset(pdf->open_stats, 0, sizeof(pdf->open_stats));
 
     pdf->box[0] = 0;
     
@@ -240,16 +317,32 @@ pdf_t* create_pdf_t(fz_context *context, fz_alloc_context *alloc_context, apv_al
 
 /**
  * free pdf_t
+ * Waits until all calls that use pdf (hold users_lock) are done.
  */
 void free_pdf_t(pdf_t *pdf) {
+    pthread_rwlock_wrlock(&pdf->users_lock);
+    if (pdf->doc && pdf->cache_dirty && !pdf->invalid_password) {
+        apv_save_cache(pdf);
+    }
+    free_page_lists(pdf, pdf->ctx, 0);
     if (pdf->doc) {
+        /* Type3 fonts kept by glyph cache and store point to doc and
+         * would lock pdf when freed, so drop them while both exist */
+        fz_purge_glyph_cache(pdf->ctx);
+        fz_empty_store(pdf->ctx);
         fz_close_document(pdf->doc);
         pdf->doc = NULL;
     }
-    /* pdf->ctx is a "reference" pointer */
+    pthread_rwlock_unlock(&pdf->users_lock);
+    pthread_rwlock_destroy(&pdf->users_lock);
+    pthread_mutex_destroy(&pdf->lists_lock);
+    pthread_mutex_destroy(&pdf->doc_lock);
+    fz_free_context(pdf->ctx);
     pdf->ctx = NULL;
     /* pdf->alloc_state is a "reference" pointer */
     pdf->alloc_state = NULL;
+    free(pdf->pages);
+    free(pdf->page_nodes);
     free(pdf);
 }
 
@@ -277,6 +370,9 @@ void maybe_free_cache(pdf_t *pdf) {
         old_size = pdf->alloc_state->current_size;
         xref = (pdf_document*)pdf->doc;
 
+        /* display lists are cheap to rebuild compared to their size */
+        free_page_lists(pdf, pdf->ctx, 1);
+
         for(i = 0; i < xref->len; ++i) {
             if (xref->table[i].obj && xref->table[i].obj->refs == 1) {
                 // APV_LOG_PRINT(APV_LOG_DEBUG, "xref entry %d refs %d", i, xref->table[i].obj->refs);
@@ -355,6 +451,136 @@ pdf_t* parse_pdf_bytes(unsigned char *bytes, size_t len, jstring box_name) {
 #endif
 
 
+/**
+ * Allocate page info for count pages, all unknown.
+ * @return 0 if ok
+ */
+static int alloc_page_info(pdf_t *pdf, int count) {
+    int i = 0;
+    free(pdf->pages);
+    pdf->page_count = 0;
+    pdf->pages = malloc(count * sizeof(apv_page_info_t));
+    if (pdf->pages == NULL) return 1;
+    for(i = 0; i < count; ++i) {
+        pdf->pages[i].num = 0;
+        pdf->pages[i].width = -1;
+        pdf->pages[i].height = -1;
+    }
+    pdf->page_count = count;
+    return 0;
+}
+
+
+/**
+ * Read linearization dictionary.
+ * Linearized files start with dictionary that gives page count and first page
+ * object, so first page can be shown before page tree is loaded.
+ * Dictionary is used only if it's consistent with the file: /L must match
+ * file length (incremental updates invalidate linearization), /O must be a page
+ * and /N must match page count from page tree root.
+ * Caller must hold pdf->doc_lock or have exclusive access to pdf.
+ */
+static void load_linearization(pdf_t *pdf) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    pdf_obj *dict = NULL;
+    pdf_obj *page = NULL;
+    pdf_obj *pages = NULL;
+    int first_num = 0;
+    int first_ofs = 0;
+    int i = 0;
+    int len = 0;
+
+    fz_var(dict);
+    fz_var(page);
+
+    /* linearization dictionary is the first object in file */
+    len = pdf_xref_len(xref);
+    for(i = 1; i < len; ++i) {
+        pdf_xref_entry *entry = pdf_get_xref_entry(xref, i);
+        if (entry->type == 'n' && entry->ofs > 0 && (first_num == 0 || entry->ofs < first_ofs)) {
+            first_num = i;
+            first_ofs = entry->ofs;
+        }
+    }
+    if (first_num == 0 || first_ofs > 1024) return;
+
+    fz_try(pdf->ctx) {
+        dict = pdf_load_object(xref, first_num, 0);
+        if (pdf_is_dict(dict)
+                && pdf_dict_gets(dict, "Linearized")
+                && pdf_to_int(pdf_dict_gets(dict, "L")) == xref->file_size
+                && pdf_to_int(pdf_dict_gets(dict, "N")) > 0
+                && pdf_to_int(pdf_dict_gets(dict, "O")) > 0
+                && pdf_to_int(pdf_dict_gets(dict, "O")) < len) {
+            page = pdf_load_object(xref, pdf_to_int(pdf_dict_gets(dict, "O")), 0);
+            pages = pdf_dict_getp(pdf_trailer(xref), "Root/Pages");
+            if (pdf_is_name(pdf_dict_gets(page, "Type"))
+                    && strcmp(pdf_to_name(pdf_dict_gets(page, "Type")), "Page") == 0
+                    && pdf_to_int(pdf_dict_gets(pages, "Count")) == pdf_to_int(pdf_dict_gets(dict, "N"))
+                    && alloc_page_info(pdf, pdf_to_int(pdf_dict_gets(dict, "N"))) == 0) {
+                pdf->pages[0].num = pdf_to_int(pdf_dict_gets(dict, "O"));
+                pdf->linearized = 1;
+            }
+        }
+    } fz_always(pdf->ctx) {
+        pdf_drop_obj(page);
+        pdf_drop_obj(dict);
+    } fz_catch(pdf->ctx) {
+        APV_LOG_PRINT(APV_LOG_WARN, "failed to read linearization dictionary");
+    }
+    if (pdf->linearized) {
+        APV_LOG_PRINT(APV_LOG_DEBUG, "linearized: %d pages, first page %d 0 R", pdf->page_count, pdf->pages[0].num);
+    }
+}
+
+
+/**
+ * Bytes read from storage by calling thread so far.
+ * @return byte count or -1 if not known
+ */
+static long long get_thread_read_bytes() {
+#ifdef RUSAGE_THREAD
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        /* ru_inblock is counted in 512 byte blocks */
+        return (long long)usage.ru_inblock * 512;
+    }
+#endif
+    return -1;
+}
+
+
+/**
+ * Mark start of open phase.
+ */
+void apv_phase_start(apv_phase_mark_t *mark) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    mark->time_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    mark->read_bytes = get_thread_read_bytes();
+}
+
+
+/**
+ * Record open phase started by apv_phase_start in pdf->open_stats.
+ * Phase must run in the thread that started it, read bytes are counted per thread.
+ */
+void apv_phase_end(pdf_t *pdf, int phase, const apv_phase_mark_t *mark) {
+    apv_open_phase_t *stats = &pdf->open_stats[phase];
+    apv_phase_mark_t end;
+    apv_phase_start(&end);
+    stats->done = 1;
+    stats->time_us = end.time_us - mark->time_us;
+    if (end.read_bytes >= 0 && mark->read_bytes >= 0) {
+        stats->read_bytes = end.read_bytes - mark->read_bytes;
+    } else {
+        stats->read_bytes = -1;
+    }
+    APV_LOG_PRINT(APV_LOG_DEBUG, "open phase %d: %lld us, %lld bytes read",
+            phase, stats->time_us, stats->read_bytes);
+}
+
+
 /**
  * Parse file into PDF struct.
  * Use filename if it's not null, otherwise use fileno.
@@ -364,24 +590,41 @@ pdf_t* parse_pdf_bytes(unsigned char *bytes, size_t len, jstring box_name) {
 pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password, fz_context *context, fz_alloc_context *alloc_context, apv_alloc_state_t *alloc_state) {
     pdf_t *pdf;
     fz_stream *stream = NULL;
+    apv_phase_mark_t mark;
 
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "parse_pdf_file(%s, %d)", filename, fileno);
 
     pdf = create_pdf_t(context, alloc_context, alloc_state);
+    if (pdf == NULL) return NULL;
 
+    apv_phase_start(&mark);
+    apv_get_file_id(filename, fileno, &pdf->file_id);
     if (filename) {
-        stream = fz_open_file(pdf->ctx, (char*)filename);
+        stream = apv_open_mapped_file(pdf->ctx, filename);
     } else {
-        stream = fz_open_fd(pdf->ctx, fileno);
+        stream = apv_open_mapped_fd(pdf->ctx, fileno);
+    }
+    if (pdf->file_id.valid) {
+        pdf->file_id.valid = apv_get_fingerprint(pdf->ctx, stream, pdf->file_id.size, &pdf->file_id.fingerprint);
     }
-    pdf->doc = (fz_document*) pdf_open_document_with_stream(context, stream);
+    apv_phase_end(pdf, APV_OPEN_PHASE_FILE, &mark);
+
+    apv_phase_start(&mark);
+    pdf->doc = apv_open_cached_document(pdf, stream);
     fz_close(stream); /* pdf->doc holds ref */
+    /* Type3 fonts use doc also from threads that don't hold doc_lock */
+    ((pdf_document*)pdf->doc)->t3lock = apv_lock_doc;
+    ((pdf_document*)pdf->doc)->t3unlock = apv_unlock_doc;
+    ((pdf_document*)pdf->doc)->t3lock_user = pdf;
+    apv_phase_end(pdf, ((pdf_document*)pdf->doc)->repaired ? APV_OPEN_PHASE_REPAIR : APV_OPEN_PHASE_XREF, &mark);
 
     pdf->invalid_password = 0;
 
     if (fz_needs_password(pdf->doc)) {
         int authenticated = 0;
+        apv_phase_start(&mark);
         authenticated = fz_authenticate_password(pdf->doc, (char*)password);
+        apv_phase_end(pdf, APV_OPEN_PHASE_CRYPT, &mark);
         if (!authenticated) {
             /* TODO: ask for password */
             APV_LOG_PRINT(APV_LOG_ERROR, "failed to authenticate");
@@ -389,12 +632,332 @@ pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password, fz
             return pdf;
         }
     }
-    
+
+    if (pdf->pages == NULL) {
+        apv_phase_start(&mark);
+        load_linearization(pdf);
+        apv_phase_end(pdf, APV_OPEN_PHASE_LINEARIZATION, &mark);
+    }
+
     pdf->last_pageno = -1;
     return pdf;
 }
 
 
+/**
+ * Check if page tree was already flattened into xref->page_objs.
+ * Caller must hold pdf->doc_lock.
+ */
+int is_page_tree_loaded(pdf_t *pdf) {
+    return ((pdf_document*)pdf->doc)->page_refs != NULL;
+}
+
+
+/* page tree deeper than this is treated as broken (or cyclic) */
+#define MAX_PAGE_TREE_DEPTH 64
+
+/* lazy page sizes are used for documents with at least this many pages */
+#define LAZY_PAGE_SIZES_MIN_PAGES 256
+
+
+/**
+ * Count pages with fz_count_pages, which loads whole page tree on first call.
+ * Page count reported before page tree was loaded comes from /Count of root
+ * node (or from linearization dictionary or cache), which can be wrong in
+ * broken files. If it doesn't match the tree, page info is reset to real
+ * count, so that lookups are limited to pages that exist and next
+ * get_page_count reports corrected count.
+ * Caller must hold pdf->doc_lock.
+ */
+static int count_tree_pages(pdf_t *pdf) {
+    apv_phase_mark_t mark;
+    int count = 0;
+    if (is_page_tree_loaded(pdf)) {
+        return fz_count_pages(pdf->doc);
+    }
+    apv_phase_start(&mark);
+    count = fz_count_pages(pdf->doc);
+    apv_phase_end(pdf, APV_OPEN_PHASE_PAGE_TREE, &mark);
+    if (pdf->pages && pdf->page_count != count) {
+        APV_LOG_PRINT(APV_LOG_WARN, "page tree has %d pages, but %d pages were reported before it was loaded",
+                count, pdf->page_count);
+        /* sizes and numbers found using broken counts can belong to other pages */
+        if (count <= 0 || alloc_page_info(pdf, count) != 0) {
+            free(pdf->pages);
+            pdf->pages = NULL;
+            pdf->page_count = 0;
+        }
+        pdf->cache_dirty = 1;
+    }
+    return count;
+}
+
+
+/**
+ * Get page count.
+ * Uses linearization dictionary, sidecar cache or /Count of root page tree
+ * node if page tree isn't loaded yet.
+ * Caller must hold pdf->doc_lock.
+ * @return page count or 0 on error
+ */
+int get_page_count(pdf_t *pdf) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    int count = 0;
+    if (pdf->pages && !is_page_tree_loaded(pdf)) {
+        return pdf->page_count;
+    }
+    fz_try(pdf->ctx) {
+        if (!is_page_tree_loaded(pdf)) {
+            /* each page is a separate object, so larger count is surely broken */
+            count = pdf_to_int(pdf_dict_getp(pdf_trailer(xref), "Root/Pages/Count"));
+            if (count <= 0 || count >= pdf_xref_len(xref) || alloc_page_info(pdf, count) != 0)
+                count = 0;
+        }
+        if (count == 0)
+            count = count_tree_pages(pdf);
+    } fz_catch(pdf->ctx) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to count pages");
+        count = 0;
+    }
+    return count;
+}
+
+
+/**
+ * Check if object is an intermediate page tree node.
+ * Same test as used by mupdf when it loads page tree.
+ */
+static int is_page_tree_node(pdf_obj *obj) {
+    return pdf_is_array(pdf_dict_gets(obj, "Kids")) && pdf_is_int(pdf_dict_gets(obj, "Count"));
+}
+
+
+/**
+ * Remember page tree node visited by find_page_num.
+ * @return index of node in pdf->page_nodes or -1 if it can't be stored
+ */
+static int add_page_node(pdf_t *pdf, int num, int first, int count) {
+    apv_page_node_t *nodes = NULL;
+    apv_page_node_t *node = NULL;
+    int cap = 0;
+    if (pdf->page_node_count == pdf->page_node_cap) {
+        cap = pdf->page_node_cap ? pdf->page_node_cap * 2 : 16;
+        nodes = realloc(pdf->page_nodes, cap * sizeof(apv_page_node_t));
+        if (nodes == NULL) return -1;
+        pdf->page_nodes = nodes;
+        pdf->page_node_cap = cap;
+    }
+    node = &pdf->page_nodes[pdf->page_node_count];
+    node->num = num;
+    node->first = first;
+    node->count = count;
+    node->next_kid = 0;
+    node->next_first = first;
+    return pdf->page_node_count++;
+}
+
+
+/**
+ * Find page object number by descending page tree using /Count of its nodes.
+ *
+ * Search starts at the deepest already visited node that contains the page.
+ * Every kid is examined at most once: pages passed on the way are stored in
+ * pdf->pages, intermediate nodes are stored in pdf->page_nodes, and scan of
+ * each node continues where previous lookup stopped. So looking up all pages
+ * costs about as much as loading whole page tree, while looking up one page
+ * resolves only nodes on its path and their preceding siblings.
+ *
+ * Caller must hold pdf->doc_lock and make sure that pdf->pages is allocated.
+ * @return object number or 0 if page can't be found this way
+ */
+static int find_page_num(pdf_t *pdf, int pageno) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    apv_page_node_t *n = NULL;
+    pdf_obj *ref = NULL;
+    pdf_obj *node = NULL;
+    pdf_obj *kids = NULL;
+    pdf_obj *kid = NULL;
+    int current = -1; /* index of node in page_nodes, -1 if it's not stored */
+    int child = -1;
+    int first = 0;
+    int count = 0;
+    int depth = 0;
+    int len = 0;
+    int i = 0;
+
+    /*
+     * Nodes under a node are stored only after they were passed by its scan,
+     * so if page is not passed yet by a node that contains it, that node is
+     * the deepest one. Node where previous lookup ended is checked first, so
+     * sequential lookups don't search all nodes.
+     */
+    n = pdf->last_page_node != -1 ? &pdf->page_nodes[pdf->last_page_node] : NULL;
+    if (n && n->next_first <= pageno && pageno < n->first + n->count) {
+        current = pdf->last_page_node;
+    } else {
+        for(i = 0; i < pdf->page_node_count; ++i) {
+            n = &pdf->page_nodes[i];
+            if (n->first <= pageno && pageno < n->first + n->count
+                    && (current == -1 || n->count < pdf->page_nodes[current].count)) {
+                current = i;
+            }
+        }
+    }
+    if (current != -1) {
+        ref = pdf_new_indirect(pdf->ctx, pdf->page_nodes[current].num, 0, xref);
+        node = pdf_resolve_indirect(ref);
+        pdf_drop_obj(ref);
+    } else {
+        ref = pdf_dict_getp(pdf_trailer(xref), "Root/Pages");
+        if (pdf_is_indirect(ref)) current = add_page_node(pdf, pdf_to_num(ref), 0, pdf->page_count);
+        node = pdf_resolve_indirect(ref);
+    }
+
+    for(depth = 0; depth < MAX_PAGE_TREE_DEPTH; ++depth) {
+        kids = pdf_dict_gets(node, "Kids");
+        len = pdf_array_len(kids);
+        i = 0;
+        if (current != -1) {
+            i = pdf->page_nodes[current].next_kid;
+            first = pdf->page_nodes[current].next_first;
+        }
+        child = -1;
+        for(; i < len; ++i) {
+            kid = pdf_array_get(kids, i);
+            if (is_page_tree_node(kid)) {
+                count = pdf_to_int(pdf_dict_gets(kid, "Count"));
+                if (count < 0) return 0;
+                if (pdf_is_indirect(kid)) child = add_page_node(pdf, pdf_to_num(kid), first, count);
+                first += count;
+                if (pageno < first) break;
+            } else {
+                if (!pdf_is_indirect(kid) || first >= pdf->page_count) return 0;
+                pdf->pages[first].num = pdf_to_num(kid);
+                first++;
+                if (pageno < first) break;
+            }
+        }
+        /* /Count of some node is wrong, or page is under direct node passed earlier */
+        if (i == len) return 0;
+        if (current != -1) {
+            pdf->page_nodes[current].next_kid = i + 1;
+            pdf->page_nodes[current].next_first = first;
+        }
+        if (!is_page_tree_node(kid)) {
+            pdf->last_page_node = current;
+            return pdf->pages[pageno].num;
+        }
+        first -= count;
+        current = child;
+        node = kid;
+    }
+    return 0;
+}
+
+
+/**
+ * Get page object number known without page tree.
+ * Looks up page in page tree lazily if its number is not known yet.
+ * Caller must hold pdf->doc_lock.
+ * @return object number or 0 if page tree is needed to find the page
+ */
+static int get_known_page_num(pdf_t *pdf, int pageno) {
+    int num = 0;
+    if (is_page_tree_loaded(pdf)) return 0;
+    if (pdf->pages == NULL) get_page_count(pdf);
+    if (pdf->pages == NULL || pageno < 0 || pageno >= pdf->page_count)
+        return 0;
+    if (pdf->pages[pageno].num > 0) return pdf->pages[pageno].num;
+    fz_try(pdf->ctx) {
+        num = find_page_num(pdf, pageno);
+    } fz_catch(pdf->ctx) {
+        num = 0;
+    }
+    if (num <= 0) {
+        APV_LOG_PRINT(APV_LOG_WARN, "lazy lookup of page %d failed, loading page tree", pageno);
+    }
+    return num;
+}
+
+
+/**
+ * Get page dictionary with inherited attributes.
+ * Caller must hold pdf->doc_lock.
+ * @return borrowed reference to page dictionary, valid until maybe_free_cache
+ */
+static pdf_obj *get_page_obj(pdf_t *pdf, int pageno) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    pdf_obj *ref = NULL;
+    pdf_obj *obj = NULL;
+    int num = get_known_page_num(pdf, pageno);
+    if (num > 0) {
+        ref = pdf_new_indirect(pdf->ctx, num, 0, xref);
+        obj = pdf_resolve_indirect(ref);
+        pdf_drop_obj(ref);
+        pdf_inherit_page_attrs(xref, obj);
+        return obj;
+    }
+    if (pageno < 0 || pageno >= count_tree_pages(pdf))
+        fz_throw(pdf->ctx, "cannot find page %d", pageno + 1);
+    return xref->page_objs[pageno];
+}
+
+
+/**
+ * Load page.
+ * Like fz_load_page, but pages whose object numbers are already known
+ * are loaded without loading page tree.
+ * Caller must hold pdf->doc_lock.
+ */
+fz_page *load_page(pdf_t *pdf, int pageno) {
+    pdf_obj *ref = NULL;
+    pdf_page *page = NULL;
+    apv_phase_mark_t mark;
+    int num = get_known_page_num(pdf, pageno);
+    if (num <= 0) {
+        /* page tree is loaded (and timed) on its own, so that first page phase covers just the page */
+        if (pageno < 0 || pageno >= count_tree_pages(pdf))
+            fz_throw(pdf->ctx, "cannot find page %d", pageno + 1);
+    }
+    apv_phase_start(&mark);
+    if (num <= 0) {
+        page = (pdf_page*)fz_load_page(pdf->doc, pageno);
+    } else {
+        ref = pdf_new_indirect(pdf->ctx, num, 0, (pdf_document*)pdf->doc);
+        fz_try(pdf->ctx) {
+            page = pdf_load_page_by_ref((pdf_document*)pdf->doc, pageno, ref);
+        } fz_always(pdf->ctx) {
+            pdf_drop_obj(ref);
+        } fz_catch(pdf->ctx) {
+            fz_rethrow(pdf->ctx);
+        }
+    }
+    if (!pdf->open_stats[APV_OPEN_PHASE_FIRST_PAGE].done) {
+        apv_phase_end(pdf, APV_OPEN_PHASE_FIRST_PAGE, &mark);
+    }
+    return (fz_page*)page;
+}
+
+
+/**
+ * Check if only first page can be shown quickly and sizes of other pages
+ * should be loaded in background: file is linearized and page tree is not
+ * loaded yet, or document is large and sizes of its pages are not known
+ * (sizes come from sidecar cache when document is opened again).
+ * Caller must hold pdf->doc_lock.
+ */
+int has_fast_first_page(pdf_t *pdf) {
+    int i = 0;
+    if (is_page_tree_loaded(pdf) || get_page_count(pdf) <= 0 || pdf->pages == NULL) return 0;
+    if (!pdf->linearized && pdf->page_count < LAZY_PAGE_SIZES_MIN_PAGES) return 0;
+    if (strcmp(pdf->pages_box, pdf->box) != 0) return 1;
+    for(i = 0; i < pdf->page_count; ++i) {
+        if (pdf->pages[i].width < 0) return 1;
+    }
+    return 0;
+}
+
+
 /**
  * Calculate zoom to best match given dimensions.
  * There's no guarantee that page zoomed by resulting zoom will fit rectangle max_width x max_height exactly.
@@ -419,39 +982,321 @@ pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password, fz
 }*/
 
 
+/**
+ * Get pdf->box of page from page dictionary.
+ * Caller must hold pdf->doc_lock.
+ * @return 1 if box was found, 0 if page bounds should be used instead
+ */
+static int get_page_box_from_dict(pdf_t *pdf, int pageno, fz_rect *box) {
+    pdf_obj *pageobj = NULL;
+    pdf_obj *obj = NULL;
+    if (!pdf->box[0] || strcmp(pdf->box, "MediaBox") == 0) {
+        /* only get box this way if pdf->box and pdf->box != "MediaBox" */
+        return 0;
+    }
+    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "getting page box using pdf_dict_gets (pdf->box: %s)", pdf->box);
+    pageobj = get_page_obj(pdf, pageno);
+    obj = pdf_dict_gets(pageobj, pdf->box);
+    if (obj && pdf_is_array(obj)) {
+        pdf_to_rect(pdf->ctx, obj, box);
+        obj = pdf_dict_gets(pageobj, "UserUnit");
+        if (pdf_is_real(obj)) {
+            float unit = pdf_to_real(obj);
+            box->x0 *= unit;
+            box->y0 *= unit;
+            box->x1 *= unit;
+            box->y1 *= unit;
+        }
+        return 1;
+    }
+    // APV_LOG_PRINT(APV_LOG_DEBUG, "box not found %s", pdf->box);
+    return 0;
+}
+
+
+/**
+ * Interpret page into display list.
+ * Caller must hold pdf->doc_lock.
+ */
+static fz_display_list *build_page_display_list(pdf_t *pdf, int pageno, int skipImages, fz_rect *mediabox, fz_rect *pagebox) {
+    fz_page *page = NULL;
+    fz_device *dev = NULL;
+    fz_display_list *list = NULL;
+    fz_rect bounds;
+
+    fz_var(page);
+    fz_var(dev);
+    fz_var(list);
+
+    if (pdf->last_pageno != pageno) {
+        pdf->last_pageno = pageno;
+    }
+
+    fz_try(pdf->ctx) {
+        page = load_page(pdf, pageno);
+        fz_bound_page(pdf->doc, page, &bounds);
+        if (mediabox) *mediabox = bounds;
+        if (pagebox && !get_page_box_from_dict(pdf, pageno, pagebox)) *pagebox = bounds;
+        list = fz_new_display_list(pdf->ctx);
+        dev = fz_new_list_device(pdf->ctx, list);
+        if (skipImages)
+            dev->hints |= FZ_IGNORE_IMAGE;
+        fz_run_page(pdf->doc, page, dev, &fz_identity, NULL);
+        /* list may hold zeros read from truncated file */
+        if (apv_is_truncated_stream(((pdf_document*)pdf->doc)->file))
+            fz_throw(pdf->ctx, "file was truncated while open");
+    } fz_always(pdf->ctx) {
+        if (dev) fz_free_device(dev);
+        if (page) fz_free_page(pdf->doc, page);
+    } fz_catch(pdf->ctx) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to load page %d", pageno);
+        if (list) fz_free_display_list(pdf->ctx, list);
+        list = NULL;
+    }
+
+    maybe_free_cache(pdf);
+
+    return list;
+}
+
+
+/**
+ * Interpret page into display list.
+ * This is the only part of rendering that uses pdf->doc, so it's done under
+ * pdf->doc_lock; resulting list can be run by any thread in its own context.
+ * @param mediabox if not NULL, receives page bounds
+ * @param pagebox if not NULL, receives page box as returned by get_page_box
+ * @return display list that needs to be freed by caller or NULL on error
+ */
+fz_display_list *get_page_display_list(pdf_t *pdf, int pageno, int skipImages, fz_rect *mediabox, fz_rect *pagebox) {
+    fz_display_list *list = NULL;
+    pthread_mutex_lock(&pdf->doc_lock);
+    list = build_page_display_list(pdf, pageno, skipImages, mediabox, pagebox);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    return list;
+}
+
+
+/**
+ * Find page list in cache and keep it.
+ * @return kept page list or NULL if page is not cached
+ */
+static apv_page_list_t *find_page_list(pdf_t *pdf, int pageno, int skipImages) {
+    apv_page_list_t *page_list = NULL;
+    int i = 0;
+    pthread_mutex_lock(&pdf->lists_lock);
+    for(i = 0; i < PAGE_LIST_CACHE_SIZE; ++i) {
+        apv_page_list_t *p = pdf->page_lists[i];
+        if (p && p->pageno == pageno && p->skip_images == skipImages) {
+            p->refs++;
+            p->last_used = ++pdf->page_list_clock;
+            page_list = p;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pdf->lists_lock);
+    return page_list;
+}
+
+
+/**
+ * Put new page list in cache in place of least recently used one.
+ * Caller must hold pdf->doc_lock, since evicted list is freed in pdf->ctx.
+ * @return kept page list, or NULL if it can't be allocated, in which case list is freed
+ */
+static apv_page_list_t *add_page_list(pdf_t *pdf, int pageno, int skipImages, fz_display_list *list, const fz_rect *pagebox) {
+    apv_page_list_t *page_list = NULL;
+    apv_page_list_t *evicted = NULL;
+    int i = 0;
+    int slot = 0;
+
+    page_list = malloc(sizeof(apv_page_list_t));
+    if (page_list == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to allocate page list");
+        fz_free_display_list(pdf->ctx, list);
+        return NULL;
+    }
+    page_list->pageno = pageno;
+    page_list->skip_images = skipImages;
+    page_list->refs = 2; /* cache slot and caller */
+    page_list->list = list;
+    page_list->pagebox = *pagebox;
+
+    pthread_mutex_lock(&pdf->lists_lock);
+    for(i = 0; i < PAGE_LIST_CACHE_SIZE; ++i) {
+        if (pdf->page_lists[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (pdf->page_lists[i]->last_used < pdf->page_lists[slot]->last_used) {
+            slot = i;
+        }
+    }
+    evicted = pdf->page_lists[slot];
+    if (evicted && --evicted->refs > 0) {
+        evicted = NULL; /* still being run, last user frees it */
+    }
+    page_list->last_used = ++pdf->page_list_clock;
+    pdf->page_lists[slot] = page_list;
+    pthread_mutex_unlock(&pdf->lists_lock);
+
+    if (evicted) {
+        fz_free_display_list(pdf->ctx, evicted->list);
+        free(evicted);
+    }
+    return page_list;
+}
+
+
+/**
+ * Get display list of page, reusing list from earlier render or prefetch.
+ * Lists are kept in small per document cache, so tiles of one page are
+ * interpreted once, and prefetched pages are not interpreted again.
+ * @return page list that caller must release with release_page_list, or NULL on error
+ */
+apv_page_list_t *acquire_page_list(pdf_t *pdf, int pageno, int skipImages) {
+    apv_page_list_t *page_list = NULL;
+    fz_display_list *list = NULL;
+    fz_rect pagebox;
+
+    page_list = find_page_list(pdf, pageno, skipImages);
+    if (page_list) return page_list;
+
+    pthread_mutex_lock(&pdf->doc_lock);
+    /* other thread could have added it while we were waiting for doc_lock */
+    page_list = find_page_list(pdf, pageno, skipImages);
+    if (page_list == NULL) {
+        /* cached lists can take much of allowed memory, drop them before interpreting if needed */
+        maybe_free_cache(pdf);
+        list = build_page_display_list(pdf, pageno, skipImages, NULL, &pagebox);
+        if (list) page_list = add_page_list(pdf, pageno, skipImages, list, &pagebox);
+    }
+    pthread_mutex_unlock(&pdf->doc_lock);
+    return page_list;
+}
+
+
+/**
+ * Release page list acquired by acquire_page_list.
+ * @param ctx context of calling thread, used to free list if it was evicted meanwhile
+ */
+void release_page_list(pdf_t *pdf, fz_context *ctx, apv_page_list_t *page_list) {
+    int last = 0;
+    pthread_mutex_lock(&pdf->lists_lock);
+    last = (--page_list->refs == 0);
+    pthread_mutex_unlock(&pdf->lists_lock);
+    if (last) {
+        fz_free_display_list(ctx, page_list->list);
+        free(page_list);
+    }
+}
+
+
+/**
+ * Drop page lists from cache.
+ * @param unused_only if true, lists that are being run stay in cache
+ */
+void free_page_lists(pdf_t *pdf, fz_context *ctx, int unused_only) {
+    apv_page_list_t *freed[PAGE_LIST_CACHE_SIZE];
+    int freed_count = 0;
+    int i = 0;
+
+    pthread_mutex_lock(&pdf->lists_lock);
+    for(i = 0; i < PAGE_LIST_CACHE_SIZE; ++i) {
+        apv_page_list_t *p = pdf->page_lists[i];
+        if (p == NULL || (unused_only && p->refs > 1)) continue;
+        pdf->page_lists[i] = NULL;
+        if (--p->refs == 0) freed[freed_count++] = p;
+    }
+    pthread_mutex_unlock(&pdf->lists_lock);
+
+    for(i = 0; i < freed_count; ++i) {
+        fz_free_display_list(ctx, freed[i]->list);
+        free(freed[i]);
+    }
+}
+
+
+/**
+ * Interpret pages into page list cache ahead of rendering.
+ * Page content is read from file and decompressed, fonts and images are loaded
+ * into resource store, but nothing is rasterized. At most
+ * PAGE_LIST_CACHE_SIZE - 1 pages are prefetched, so that page being shown
+ * is not evicted, and prefetch stops when over half of allowed memory is
+ * used. Holds doc_lock while interpreting each page, so it should be called
+ * from low priority thread.
+ * @param ctx context of calling thread
+ * @param pages 0-based page numbers, most wanted first; pages out of range are skipped
+ * @return number of pages that are in cache
+ */
+int prefetch_pages(pdf_t *pdf, fz_context *ctx, const int *pages, int count, int skipImages) {
+    apv_page_list_t *page_list = NULL;
+    int page_count = 0;
+    int prefetched = 0;
+    int i = 0;
+
+    pthread_mutex_lock(&pdf->doc_lock);
+    page_count = get_page_count(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+
+    for(i = 0; i < count && prefetched < PAGE_LIST_CACHE_SIZE - 1; ++i) {
+        if (pages[i] < 0 || pages[i] >= page_count) continue;
+        if (pdf->alloc_state && pdf->alloc_state->max_size > 0
+                && pdf->alloc_state->current_size > pdf->alloc_state->max_size / 2) {
+            /* short of memory, maybe_free_cache would drop prefetched lists anyway */
+            break;
+        }
+        page_list = acquire_page_list(pdf, pages[i], skipImages);
+        if (page_list == NULL) continue;
+        release_page_list(pdf, ctx, page_list);
+        prefetched++;
+    }
+    return prefetched;
+}
+
+
 /**
  * Get part of page as bitmap.
  * Parameters left, top, width and height are interprted after scalling, so if
  * we have 100x200 page scalled by 25% and request 0x0 x 25x50 tile, we should
  * get 25x50 bitmap of whole page content. pageno is 0-based.
+ * Page is interpreted under pdf->doc_lock, unless its display list is cached,
+ * but rasterized in ctx, which must belong to calling thread.
+ * Tiles with less than full image detail are drawn from the same display list
+ * as full ones, so they can be refined without interpreting page again.
+ * @param aa_level anti-aliasing bits, one of APV_AA_*; used for text and graphics
+ * @param image_detail one of APV_IMAGES_*, receives APV_IMAGES_FULL if no image
+ * had to be drawn with less detail than that
  * Returns fz_image that needs to be freed by caller.
  */
 fz_pixmap *get_page_image_bitmap(
         pdf_t *pdf,
+        fz_context *ctx,
         int pageno, int zoom_pmil,
         int left, int top, int rotation,
-        int skipImages,
+        int aa_level,
+        int *image_detail,
         int width, int height) {
     fz_matrix ctm;
     double zoom;
     fz_irect bbox;
-    fz_page *page = NULL;
+    fz_rect pagebox;
+    fz_rect area;
+    apv_page_list_t *page_list = NULL;
     fz_pixmap *image = NULL;
     fz_device *dev = NULL;
-    static int runs = 0;
+    fz_device *detail_dev = NULL;
+    int skip_images = *image_detail == APV_IMAGES_SKIP;
+    int reduced = 0;
+    int saved_aa_level = fz_aa_level(ctx);
 
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "get_page_image_bitmap(pageno: %d) start", (int)pageno);
 
     zoom = (double)zoom_pmil / 1000.0;
 
-    if (pdf->last_pageno != pageno) {
-        pdf->last_pageno = pageno;
-    }
-
-    page = fz_load_page(pdf->doc, pageno);
-    if (!page) return NULL; /* TODO: handle/propagate errors */
-
-    fz_rect pagebox = get_page_box(pdf, pageno);
+    page_list = acquire_page_list(pdf, pageno, skip_images);
+    if (!page_list) return NULL; /* TODO: handle/propagate errors */
+    pagebox = page_list->pagebox;
 
     /* translate coords to apv coords so we can easily cut out our tile */
     ctm = fz_identity;
@@ -470,18 +1315,35 @@ fz_pixmap *get_page_image_bitmap(
     bbox.y0 = bbox.y0 + top;
     bbox.x1 = bbox.x0 + width;
     bbox.y1 = bbox.y0 + height;
+    fz_rect_from_irect(&area, &bbox);
 
-    image = fz_new_pixmap_with_bbox(pdf->ctx, fz_device_bgr(pdf->ctx), &bbox);
-    fz_clear_pixmap_with_value(pdf->ctx, image, 0xff);
-    dev = fz_new_draw_device(pdf->ctx, image);
+    if (*image_detail == APV_IMAGES_FULL) predecode_images(ctx, page_list->list, &ctm, &area);
 
-    if (skipImages)
-        dev->hints |= FZ_IGNORE_IMAGE;
+    fz_var(image);
+    fz_var(dev);
+    fz_var(detail_dev);
 
-    fz_run_page(pdf->doc, page, dev, &ctm, NULL);
+    /* ctx belongs to calling thread, so level can be set just for this tile */
+    fz_set_aa_level(ctx, aa_level);
 
-	fz_free_page(pdf->doc, page);
-    fz_free_device(dev);
+    fz_try(ctx) {
+        image = fz_new_pixmap_with_bbox(ctx, fz_device_bgr(ctx), &bbox);
+        fz_clear_pixmap_with_value(ctx, image, 0xff);
+        dev = fz_new_draw_device(ctx, image);
+        if (*image_detail == APV_IMAGES_PLACEHOLDER || *image_detail == APV_IMAGES_LOW) {
+            detail_dev = new_image_detail_device(ctx, dev, *image_detail, &reduced);
+        }
+        fz_run_display_list(page_list->list, detail_dev ? detail_dev : dev, &ctm, &area, NULL);
+    } fz_always(ctx) {
+        if (detail_dev) fz_free_device(detail_dev);
+        if (dev) fz_free_device(dev);
+        release_page_list(pdf, ctx, page_list);
+        fz_set_aa_level(ctx, saved_aa_level);
+    } fz_catch(ctx) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to render page %d", pageno);
+        /* return what was drawn so far */
+    }
+    if (detail_dev && reduced == 0) *image_detail = APV_IMAGES_FULL;
 
     /*
     __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "got image %d x %d, asked for %d x %d",
@@ -489,12 +1351,12 @@ fz_pixmap *get_page_image_bitmap(
             *width, *height);
     */
 
-    runs += 1;
     return image;
 }
 
 /**
  * Get page size in APV's convention.
+ * Caller must hold pdf->doc_lock.
  * @param page 0-based page number
  * @param pdf pdf struct
  * @param width target for width value
@@ -502,50 +1364,57 @@ fz_pixmap *get_page_image_bitmap(
  * @return error code - 0 means ok
  */
 int get_page_size(pdf_t *pdf, int pageno, int *width, int *height) {
-    fz_rect rect = get_page_box(pdf, pageno);
+    fz_rect rect;
+    int i = 0;
+
+    if (pdf->pages && pageno >= 0 && pageno < pdf->page_count
+            && strcmp(pdf->pages_box, pdf->box) == 0 && pdf->pages[pageno].width >= 0) {
+        *width = pdf->pages[pageno].width;
+        *height = pdf->pages[pageno].height;
+        return 0;
+    }
+    fz_try(pdf->ctx) {
+        rect = get_page_box(pdf, pageno);
+    } fz_catch(pdf->ctx) {
+        return 1;
+    }
     *width = rect.x1 - rect.x0;
     *height = rect.y1 - rect.y0;
     // APV_LOG_PRINT(APV_LOG_DEBUG, "get_page_size(%d) -> %d %d", pageno, *width, *height);
+
+    /* remember size for sidecar cache */
+    if (pdf->pages == NULL && alloc_page_info(pdf, get_page_count(pdf)) != 0) return 0;
+    if (strcmp(pdf->pages_box, pdf->box) != 0) {
+        for(i = 0; i < pdf->page_count; ++i) {
+            pdf->pages[i].width = -1;
+            pdf->pages[i].height = -1;
+        }
+        strcpy(pdf->pages_box, pdf->box);
+    }
+    if (pageno < pdf->page_count) {
+        pdf->pages[pageno].width = *width;
+        pdf->pages[pageno].height = *height;
+        pdf->cache_dirty = 1;
+    }
     return 0;
 }
 
 
 /**
  * Get page box.
+ * Caller must hold pdf->doc_lock.
  */
 fz_rect get_page_box(pdf_t *pdf, int pageno) {
-    fz_rect box;
+    fz_rect box = fz_empty_rect;
     fz_page *page = NULL;
-    if (pdf->box && pdf->box[0] && strcmp(pdf->box, "MediaBox") != 0) {
-        /* only get box this way if pdf->box and pdf->box != "MediaBox" */
-        // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "getting page box using pdf_dict_gets (pdf->box: %s)", pdf->box);
-        pdf_obj *pageobj = NULL;
-        pdf_obj *obj = NULL;
-        pdf_document *xref = NULL;
-        xref = (pdf_document*)pdf->doc;
-        pageobj = xref->page_objs[pageno];
-        obj = pdf_dict_gets(pageobj, pdf->box);
-        if (obj && pdf_is_array(obj)) {
-            pdf_to_rect(pdf->ctx, obj, &box);
-            obj = pdf_dict_gets(pageobj, "UserUnit");
-            if (pdf_is_real(obj)) {
-                float unit = pdf_to_real(obj);
-                box.x0 *= unit;
-                box.y0 *= unit;
-                box.x1 *= unit;
-                box.y1 *= unit;
-            }
-            return box;
-        } else {
-            // APV_LOG_PRINT(APV_LOG_DEBUG, "box not found %s", pdf->box);
-        }
-    }
+
+    if (get_page_box_from_dict(pdf, pageno, &box)) return box;
 
     /* default box */
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "getting page box using fz_bound_page (pdf->box: %s)", pdf->box);
-    page = fz_load_page(pdf->doc, pageno);
+    page = load_page(pdf, pageno);
     if (!page) {
-        APV_LOG_PRINT(APV_LOG_ERROR, "fz_load_page(..., %d) -> NULL", pageno);
+        APV_LOG_PRINT(APV_LOG_ERROR, "load_page(..., %d) -> NULL", pageno);
         return box;
     }
     fz_bound_page(pdf->doc, page, &box);
@@ -627,9 +1496,6 @@ int convert_point_pdf_to_apv(pdf_t *pdf, int page, int *x, int *y) {
  */
 int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
     fz_rect page_bbox;
-    fz_rect param_bbox;
-    // float height = 0;
-    // float width = 0;
 
     /*
     __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
@@ -637,9 +1503,24 @@ int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
             page, bbox->x0, bbox->y0, bbox->x1, bbox->y1);
     */
 
-    param_bbox = *bbox;
-
     page_bbox = get_page_box(pdf, page);
+    convert_box_to_apv(&page_bbox, rotation, bbox);
+    return 0;
+}
+
+
+/**
+ * Convert coordinates from pdf to APV, given page box as returned by get_page_box.
+ * Does not use pdf, so it can be called without pdf->doc_lock.
+ */
+void convert_box_to_apv(const fz_rect *page_box, int rotation, fz_rect *bbox) {
+    fz_rect page_bbox;
+    fz_rect param_bbox;
+    // float height = 0;
+    // float width = 0;
+
+    param_bbox = *bbox;
+    page_bbox = *page_box;
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "page bbox is %.1f, %.1f, %.1f, %.1f", page_bbox.x0, page_bbox.y0, page_bbox.x1, page_bbox.y1);
 
     if (rotation != 0) {
@@ -674,8 +1555,6 @@ int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
             "result after transformations: %.2f, %.2f, %.2f, %.2f",
             bbox->x0, bbox->y0, bbox->x1, bbox->y1);
     */
-
-    return 0;
 }
 
 
@@ -708,58 +1587,5 @@ void append_chars(char **buf, size_t *buf_size, const char *new_chars, size_t ne
 }
 
 
-// #ifdef pro
-// /**
-//  * Extract text from given pdf page.
-//  * Returns dynamically allocated string to be freed by caller or NULL.
-//  */
-// char* extract_text(pdf_t *pdf, int pageno) {
-//     fz_device *dev = NULL;
-//     fz_page *page = NULL;
-//     fz_text_sheet *text_sheet = NULL;
-//     fz_text_page *text_page = NULL;
-//     int block_no = 0;
-//     int line_no = 0;
-//     int span_no = 0;
-//     int char_no = 0;
-//     char runechars[128] = "";
-//     int runelen = 0;
-//     fz_buffer *buf = NULL;
-//     fz_output *out = NULL;
-//     fz_cookie cookie = { 0 };
-//     fz_rect pagebox;
-// 
-//     size_t text_buf_size = 0;
-//     char *text = NULL; /* utf-8 text */
-// 
-//     if (pdf == NULL) {
-//         APV_LOG_PRINT(APV_LOG_ERROR, "extract_text: pdf is NULL");
-//         return NULL;
-//     }
-// 
-//     page = fz_load_page(pdf->doc, pageno);
-//     text_sheet = fz_new_text_sheet(pdf->ctx);
-//     text_page = fz_new_text_page(pdf->ctx, fz_bound_page(pdf->doc, page, &pagebox));
-//     dev = fz_new_text_device(pdf->ctx, text_sheet, text_page);
-//     fz_run_page(pdf->doc, page, dev, &fz_identity, &cookie);
-//     fz_free_device(dev);
-//     dev = NULL;
-//     buf = fz_new_buffer(pdf->ctx, 512);
-//     out = fz_new_output_with_buffer(pdf->ctx, buf);
-// 
-//     fz_print_text_page(pdf->ctx, out, text_page);
-// 
-//     fz_free_text_page(pdf->ctx, text_page);
-//     fz_free_text_sheet(pdf->ctx, text_sheet);
-//     fz_close_output(out);  /* frees fz_output, but not buf */
-//     text = strndup(buf->data, buf->len);
-//     fz_drop_buffer(pdf->ctx, buf);  /* free both buf->data and buf itself */
-// 
-//     return text;
-// }
-// #endif
-
-
-
 /* vim: set sts=4 ts=4 sw=4 et: */
 
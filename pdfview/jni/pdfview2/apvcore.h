@@ -7,11 +7,14 @@
 #define APVCORE_H__
 
 
+#include <pthread.h>
+
 #include "fitz.h"
 #include "mupdf.h"
 
 #define MAX_BOX_NAME 8
 #define NUM_BOXES 5
+#define PAGE_LIST_CACHE_SIZE 4
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
@@ -45,15 +48,144 @@ typedef struct {
 } apv_alloc_header_t;
 
 
+/**
+ * Page info known without loading page tree, from linearization dictionary,
+ * sidecar cache or lazy page tree lookups.
+ */
+typedef struct {
+    int num; /* page object number, 0 if unknown */
+    int width; /* size of pdf->pages_box, -1 if unknown */
+    int height;
+} apv_page_info_t;
+
+
+/**
+ * Identity of document contents, used to find and validate sidecar cache.
+ * Stays the same when file is moved or copied, see apvfingerprint.c.
+ */
+typedef struct {
+    int valid;
+    long long size;
+    unsigned long long fingerprint;
+} apv_file_id_t;
+
+
+/**
+ * Intermediate page tree node found by lazy page lookup.
+ */
+typedef struct {
+    int num; /* node object number */
+    int first; /* index of first page under node */
+    int count; /* /Count of node */
+    int next_kid; /* kids before this one were already visited */
+    int next_first; /* index of first page under next_kid */
+} apv_page_node_t;
+
+
+/**
+ * Display list of page kept for reuse by renderPage tiles and prefetch.
+ * refs counts cache slot and callers that run the list, list is freed when
+ * the last one releases it.
+ */
+typedef struct {
+    int pageno;
+    int skip_images;
+    int refs;
+    int last_used; /* value of pdf->page_list_clock on last use */
+    fz_display_list *list;
+    fz_rect pagebox; /* as returned by get_page_box */
+} apv_page_list_t;
+
+
+/**
+ * Phases of opening document and showing its first page, timed separately
+ * so that slow opens can be attributed to xref parsing, repair, decryption,
+ * page tree loading or first page.
+ */
+#define APV_OPEN_PHASE_FILE 0 /* opening and mapping file */
+#define APV_OPEN_PHASE_XREF 1 /* xref and trailer, or sidecar cache */
+#define APV_OPEN_PHASE_REPAIR 2 /* whole xref phase if file had to be repaired */
+#define APV_OPEN_PHASE_CRYPT 3 /* password check and key setup */
+#define APV_OPEN_PHASE_LINEARIZATION 4
+#define APV_OPEN_PHASE_PAGE_TREE 5 /* loading whole page tree */
+#define APV_OPEN_PHASE_FIRST_PAGE 6 /* first load_page */
+#define APV_OPEN_PHASES 7
+
+
+/**
+ * Image detail of rendered tiles, from cheapest; same values as PDF.IMAGES_*.
+ */
+#define APV_IMAGES_SKIP 0 /* images are not drawn at all */
+#define APV_IMAGES_PLACEHOLDER 1 /* larger images are drawn as gray boxes */
+#define APV_IMAGES_LOW 2 /* larger images are decoded at reduced resolution if format allows it, placeholders otherwise */
+#define APV_IMAGES_FULL 3
+
+
+/**
+ * Anti-aliasing levels of rendered tiles, in bits as in fz_set_aa_level; same
+ * values as PDF.AA_*. Fitz has one level for both text and graphics.
+ */
+#define APV_AA_OFF 0
+#define APV_AA_LOW 2 /* 4 levels of coverage */
+#define APV_AA_FULL 8
+
+
+/**
+ * Time and storage reads of one open phase.
+ * read_bytes are bytes that calling thread read from storage, including mapped
+ * file page faults, -1 if not known.
+ */
+typedef struct {
+    int done;
+    long long time_us;
+    long long read_bytes;
+} apv_open_phase_t;
+
+
+/**
+ * Start of measured open phase, see apv_phase_start.
+ */
+typedef struct {
+    long long time_us;
+    long long read_bytes;
+} apv_phase_mark_t;
+
+
 /**
  * Holds pdf info.
+ * doc and ctx may only be used while doc_lock is held; doc->ctx is ctx, so
+ * each pdf_t has its own context cloned from the shared one. Work that does
+ * not touch doc (rasterizing display lists, text extraction) runs in caller's
+ * own context without doc_lock. Type3 fonts may still touch doc there (their
+ * glyphs are run in doc->ctx and their resources are dropped with them), so
+ * doc_lock is recursive and fonts take it through pdf_document t3lock hooks.
+ * users_lock is held for reading by every call that uses this pdf_t and for
+ * writing when it is freed.
+ * lists_lock guards page_lists; it may be taken while doc_lock is held, but
+ * never the other way around.
  */
 typedef struct {
     int last_pageno;
     fz_context *ctx;
     fz_document *doc;
+    pthread_mutex_t doc_lock;
+    pthread_rwlock_t users_lock;
+    pthread_mutex_t lists_lock;
+    apv_page_list_t *page_lists[PAGE_LIST_CACHE_SIZE]; /* recently rendered and prefetched pages */
+    int page_list_clock;
     int fileno; /* used only when opening by file descriptor */
     int invalid_password;
+    int linearized; /* file has valid linearization dictionary */
+    int page_count; /* number of pages entries, 0 if pages is NULL */
+    apv_page_info_t *pages; /* used until page tree is loaded, and to fill sidecar cache */
+    char pages_box[MAX_BOX_NAME + 1]; /* box that pages sizes were measured with */
+    apv_page_node_t *page_nodes; /* page tree nodes visited by lazy page lookup */
+    int page_node_count;
+    int page_node_cap;
+    int last_page_node; /* index of node where last lookup ended, -1 if none */
+    apv_file_id_t file_id;
+    int cache_dirty; /* sidecar cache should be written when pdf is freed */
+    apv_open_phase_t open_stats[APV_OPEN_PHASES];
     char box[MAX_BOX_NAME + 1];
     fz_alloc_context *alloc_context;
     apv_alloc_state_t *alloc_state;
@@ -76,24 +208,66 @@ void *apv_malloc(void *user, unsigned int size);
 void *apv_realloc(void *user, void *old, unsigned int size);
 void apv_free(void *user, void *ptr);
 
+fz_locks_context *apv_new_locks_context();
+
 pdf_t* create_pdf_t(fz_context *ctx, fz_alloc_context *alloc_context, apv_alloc_state_t *alloc_state);
 void free_pdf_t(pdf_t *pdf);
 void maybe_free_cache(pdf_t *pdf);
 pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password, fz_context *context, fz_alloc_context *alloc_context, apv_alloc_state_t *alloc_state);
+void apv_phase_start(apv_phase_mark_t *mark);
+void apv_phase_end(pdf_t *pdf, int phase, const apv_phase_mark_t *mark);
+int get_page_count(pdf_t *pdf);
+int is_page_tree_loaded(pdf_t *pdf);
+fz_page *load_page(pdf_t *pdf, int pageno);
+int has_fast_first_page(pdf_t *pdf);
 void fix_samples(unsigned char *bytes, unsigned int w, unsigned int h);
 void rgb_to_alpha(unsigned char *bytes, unsigned int w, unsigned int h);
 int get_page_size(pdf_t *pdf, int pageno, int *width, int *height);
 void pdf_android_loghandler(const char *m);
 int convert_point_pdf_to_apv(pdf_t *pdf, int page, int *x, int *y);
 int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox);
+void convert_box_to_apv(const fz_rect *page_box, int rotation, fz_rect *bbox);
 pdf_page* get_page(pdf_t *pdf, int pageno);
 fz_rect get_page_box(pdf_t *pdf, int pageno);
 wchar_t* widestrstr(wchar_t *haystack, int haystack_length, wchar_t *needle, int needle_length);
+fz_display_list *get_page_display_list(pdf_t *pdf, int pageno, int skipImages, fz_rect *mediabox, fz_rect *pagebox);
+apv_page_list_t *acquire_page_list(pdf_t *pdf, int pageno, int skipImages);
+void release_page_list(pdf_t *pdf, fz_context *ctx, apv_page_list_t *page_list);
+void free_page_lists(pdf_t *pdf, fz_context *ctx, int unused_only);
+int prefetch_pages(pdf_t *pdf, fz_context *ctx, const int *pages, int count, int skipImages);
 fz_pixmap *get_page_image_bitmap(
       pdf_t *pdf,
+      fz_context *ctx,
       int pageno, int zoom_pmil,
       int left, int top, int rotation,
-      int skipImages,
+      int aa_level,
+      int *image_detail,
       int width,
       int height);
 
+/**
+ * Text export progress callback, called after each written page.
+ * Returning non-zero aborts export.
+ */
+typedef int (*apv_export_progress_t)(void *user, int pages_done, int pages_total);
+int export_text(pdf_t *pdf, fz_context *ctx, int fd, int first_page, int last_page, apv_export_progress_t progress, void *progress_user);
+
+/* parallel decoding of tile's images before it is drawn, and image detail of tiles */
+void predecode_images(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, const fz_rect *area);
+fz_device *new_image_detail_device(fz_context *ctx, fz_device *target, int image_detail, int *reduced);
+
+/* sidecar cache of xref and page info */
+void apv_set_cache_dir(const char *dir);
+int apv_get_file_id(const char *filename, int fd, apv_file_id_t *file_id);
+fz_document *apv_open_cached_document(pdf_t *pdf, fz_stream *stream);
+void apv_save_cache(pdf_t *pdf);
+int apv_create_temp_file();
+
+/* document fingerprint */
+int apv_get_fingerprint(fz_context *ctx, fz_stream *stm, long long size, unsigned long long *fingerprint);
+
+/* memory mapped input streams, fall back to fz_open_fd if file can't be mapped */
+fz_stream *apv_open_mapped_fd(fz_context *ctx, int fd);
+fz_stream *apv_open_mapped_file(fz_context *ctx, const char *filename);
+int apv_is_truncated_stream(fz_stream *stm);
+
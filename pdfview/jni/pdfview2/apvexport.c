@@ -0,0 +1,437 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "apvcore.h"
+
+#include "mupdf-internal.h"
+
+
+/*
+ * Whole document text export.
+ *
+ * Pages are interpreted one by one on the calling thread (under pdf->doc_lock,
+ * so other calls can use pdf between pages) into display lists. Worker threads,
+ * each with its own cloned fz_context, run those lists through the text device
+ * and serialize text to UTF-8. Calling thread writes finished pages to fd in
+ * page order. At most num_slots pages are in flight, so memory use does not
+ * depend on document size. If no worker could be started, or all of them
+ * failed to set up, calling thread extracts text itself.
+ */
+
+
+#define EXPORT_MAX_WORKERS 4
+
+#define EXPORT_SLOT_FREE 0
+#define EXPORT_SLOT_QUEUED 1
+#define EXPORT_SLOT_RUNNING 2
+#define EXPORT_SLOT_DONE 3
+
+
+typedef struct {
+    int state;
+    int pageno;
+    fz_rect mediabox;
+    fz_display_list *list;
+    fz_buffer *text;
+} export_slot_t;
+
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fz_context *ctx; /* context that worker contexts are cloned from */
+    export_slot_t *slots;
+    int num_slots;
+    int first_page;
+    int next_job; /* index of next page to be picked up by worker */
+    int num_queued; /* number of pages queued so far */
+    int live_workers; /* workers that may still take queued pages */
+    int stop;
+} export_state_t;
+
+
+/**
+ * Run display list through text device and serialize its text as UTF-8.
+ * Lines end with '\n', blocks are separated by empty line.
+ * Returns newly allocated buffer, never NULL, throws on errors.
+ */
+static fz_buffer *extract_list_text(fz_context *ctx, fz_text_sheet *sheet, fz_display_list *list, const fz_rect *mediabox) {
+    fz_text_page *text_page = NULL;
+    fz_device *dev = NULL;
+    fz_buffer *buf = NULL;
+    int block_no = 0;
+
+    fz_var(text_page);
+    fz_var(dev);
+    fz_var(buf);
+
+    fz_try(ctx) {
+        text_page = fz_new_text_page(ctx, mediabox);
+        dev = fz_new_text_device(ctx, sheet, text_page);
+        fz_run_display_list(list, dev, &fz_identity, NULL, NULL);
+        fz_free_device(dev);
+        dev = NULL;
+
+        buf = fz_new_buffer(ctx, 1024);
+        for(block_no = 0; block_no < text_page->len; ++block_no) {
+            fz_text_block *text_block = NULL;
+            fz_text_line *text_line = NULL;
+            fz_text_span *text_span = NULL;
+            if (text_page->blocks[block_no].type != FZ_PAGE_BLOCK_TEXT) continue;
+            text_block = text_page->blocks[block_no].u.text;
+            for(text_line = text_block->lines; text_line < text_block->lines + text_block->len; ++text_line) {
+                for(text_span = text_line->first_span; text_span; text_span = text_span->next) {
+                    int char_no = 0;
+                    for(char_no = 0; char_no < text_span->len; ++char_no) {
+                        fz_write_buffer_rune(ctx, buf, text_span->text[char_no].c);
+                    }
+                }
+                fz_write_buffer_byte(ctx, buf, '\n');
+            }
+            fz_write_buffer_byte(ctx, buf, '\n');
+        }
+    } fz_always(ctx) {
+        if (dev) fz_free_device(dev);
+        if (text_page) fz_free_text_page(ctx, text_page);
+    } fz_catch(ctx) {
+        fz_drop_buffer(ctx, buf);
+        fz_rethrow(ctx);
+    }
+
+    return buf;
+}
+
+
+/**
+ * Extract text from slot's display list, never throws.
+ * On error slot->text holds whatever could be extracted (possibly nothing).
+ */
+static void export_slot(fz_context *ctx, fz_text_sheet *sheet, export_slot_t *slot) {
+    if (slot->list == NULL) {
+        slot->text = NULL;
+        return;
+    }
+    fz_try(ctx) {
+        slot->text = extract_list_text(ctx, sheet, slot->list, &slot->mediabox);
+    } fz_catch(ctx) {
+        APV_LOG_PRINT(APV_LOG_WARN, "failed to extract text of page %d", slot->pageno);
+        slot->text = NULL;
+    }
+}
+
+
+/**
+ * Extract text of slot on calling thread, used when no worker is left.
+ * Text sheet is created on first use.
+ * @return 0 on success, -1 if text sheet could not be created
+ */
+static int export_slot_inline(fz_context *ctx, fz_text_sheet **sheet, export_slot_t *slot) {
+    if (*sheet == NULL) {
+        fz_text_sheet *new_sheet = NULL;
+        fz_try(ctx) {
+            new_sheet = fz_new_text_sheet(ctx);
+        } fz_catch(ctx) {
+            APV_LOG_PRINT(APV_LOG_ERROR, "failed to create text sheet");
+            return -1;
+        }
+        *sheet = new_sheet;
+    }
+    export_slot(ctx, *sheet, slot);
+    slot->state = EXPORT_SLOT_DONE;
+    return 0;
+}
+
+
+/**
+ * Called by worker that exits before taking any page, so that calling thread
+ * does not wait for it.
+ */
+static void export_worker_failed(export_state_t *state) {
+    pthread_mutex_lock(&state->lock);
+    state->live_workers -= 1;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+
+/**
+ * Worker thread main routine: take queued pages in page order until stopped.
+ */
+static void *export_worker(void *arg) {
+    export_state_t *state = arg;
+    fz_context *ctx = NULL;
+    fz_text_sheet *sheet = NULL;
+
+    ctx = fz_clone_context(state->ctx);
+    if (ctx == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to clone fitz context");
+        export_worker_failed(state);
+        return NULL;
+    }
+
+    fz_try(ctx) {
+        sheet = fz_new_text_sheet(ctx);
+    } fz_catch(ctx) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to create text sheet");
+        fz_free_context(ctx);
+        export_worker_failed(state);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    while(1) {
+        export_slot_t *slot = NULL;
+        while(!state->stop && state->next_job >= state->num_queued) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        if (state->stop) break;
+        slot = &state->slots[state->next_job % state->num_slots];
+        state->next_job += 1;
+        slot->state = EXPORT_SLOT_RUNNING;
+        pthread_mutex_unlock(&state->lock);
+
+        export_slot(ctx, sheet, slot);
+
+        pthread_mutex_lock(&state->lock);
+        slot->state = EXPORT_SLOT_DONE;
+        pthread_cond_broadcast(&state->cond);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    fz_free_text_sheet(ctx, sheet);
+    fz_free_context(ctx);
+    return NULL;
+}
+
+
+/**
+ * Interpret page into slot's display list. Images are not needed for text, so
+ * they are not even loaded.
+ */
+static void load_slot(pdf_t *pdf, export_slot_t *slot, int pageno) {
+    fz_page *page = NULL;
+    fz_device *dev = NULL;
+
+    fz_var(page);
+    fz_var(dev);
+
+    slot->pageno = pageno;
+    slot->list = NULL;
+    slot->text = NULL;
+    slot->mediabox = fz_empty_rect;
+
+    pthread_mutex_lock(&pdf->doc_lock);
+    fz_try(pdf->ctx) {
+        page = load_page(pdf, pageno);
+        fz_bound_page(pdf->doc, page, &slot->mediabox);
+        slot->list = fz_new_display_list(pdf->ctx);
+        dev = fz_new_list_device(pdf->ctx, slot->list);
+        dev->hints |= FZ_IGNORE_IMAGE;
+        fz_run_page(pdf->doc, page, dev, &fz_identity, NULL);
+    } fz_always(pdf->ctx) {
+        if (dev) fz_free_device(dev);
+        if (page) fz_free_page(pdf->doc, page);
+    } fz_catch(pdf->ctx) {
+        APV_LOG_PRINT(APV_LOG_WARN, "failed to load page %d for export", pageno);
+        /* keep partial list: text extracted up to the error is still useful */
+    }
+    if (slot->list && apv_is_truncated_stream(((pdf_document*)pdf->doc)->file)) {
+        /* unlike partial page, text read from truncated file is just garbage */
+        APV_LOG_PRINT(APV_LOG_WARN, "file was truncated while open, skipping page %d", pageno);
+        fz_free_display_list(pdf->ctx, slot->list);
+        slot->list = NULL;
+    }
+    pthread_mutex_unlock(&pdf->doc_lock);
+}
+
+
+/**
+ * Free slot's display list and text.
+ */
+static void free_slot(fz_context *ctx, export_slot_t *slot) {
+    if (slot->list) {
+        fz_free_display_list(ctx, slot->list);
+        slot->list = NULL;
+    }
+    if (slot->text) {
+        fz_drop_buffer(ctx, slot->text);
+        slot->text = NULL;
+    }
+    slot->state = EXPORT_SLOT_FREE;
+}
+
+
+/**
+ * Write whole buffer to fd, retrying on short writes.
+ * @return 0 on success, -1 on error
+ */
+static int write_fully(int fd, const unsigned char *data, int len) {
+    while(len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            APV_LOG_PRINT(APV_LOG_ERROR, "write failed: %s", strerror(errno));
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+/**
+ * Write page text followed by form feed.
+ */
+static int write_slot(int fd, export_slot_t *slot) {
+    static const unsigned char page_separator[] = "\f";
+    if (slot->text && write_fully(fd, slot->text->data, slot->text->len) != 0) return -1;
+    return write_fully(fd, page_separator, 1);
+}
+
+
+/**
+ * Get number of export worker threads to use.
+ */
+static int get_num_workers() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    return MIN(cpus, EXPORT_MAX_WORKERS);
+}
+
+
+/**
+ * Export text of pages first_page..last_page (0-based, inclusive) as UTF-8 to fd.
+ * Pages are separated by form feed character.
+ * Progress is reported after each written page; if progress callback returns
+ * non-zero, export is aborted.
+ * ctx is calling thread's context, worker contexts are cloned from it.
+ * @return number of pages written or -1 on error
+ */
+int export_text(pdf_t *pdf, fz_context *ctx, int fd, int first_page, int last_page, apv_export_progress_t progress, void *progress_user) {
+    export_state_t state;
+    pthread_t workers[EXPORT_MAX_WORKERS];
+    fz_text_sheet *sheet = NULL; /* used only when no worker is left */
+    int num_workers = 0;
+    int num_pages = 0;
+    int written = 0;
+    int failed = 0;
+    int i = 0;
+
+    if (pdf == NULL || pdf->doc == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "export_text: pdf is NULL");
+        return -1;
+    }
+
+    first_page = MAX(first_page, 0);
+    pthread_mutex_lock(&pdf->doc_lock);
+    last_page = MIN(last_page, get_page_count(pdf) - 1);
+    pthread_mutex_unlock(&pdf->doc_lock);
+    num_pages = last_page - first_page + 1;
+    if (num_pages <= 0) return 0;
+
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    state.ctx = ctx;
+    state.first_page = first_page;
+
+    /* workers are started before first page; single page exports do not
+     * need any */
+    num_workers = MIN(get_num_workers(), num_pages - 1);
+    state.num_slots = MAX(2 * num_workers, 1);
+    state.slots = calloc(state.num_slots, sizeof(export_slot_t));
+    if (state.slots == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to allocate export slots");
+        pthread_cond_destroy(&state.cond);
+        pthread_mutex_destroy(&state.lock);
+        return -1;
+    }
+
+    state.live_workers = num_workers;
+    for(i = 0; i < num_workers; ++i) {
+        if (pthread_create(&workers[i], NULL, export_worker, &state) != 0) {
+            APV_LOG_PRINT(APV_LOG_WARN, "failed to start export worker %d", i);
+            break;
+        }
+    }
+    pthread_mutex_lock(&state.lock);
+    state.live_workers -= num_workers - i;
+    pthread_mutex_unlock(&state.lock);
+    num_workers = i;
+
+    for(i = 0; i < num_pages + state.num_slots && !failed; ++i) {
+        /* write page that was queued num_slots pages ago, freeing its slot */
+        if (i >= state.num_slots && i - state.num_slots < num_pages) {
+            export_slot_t *slot = &state.slots[(i - state.num_slots) % state.num_slots];
+            int run_inline = 0;
+            pthread_mutex_lock(&state.lock);
+            while(slot->state != EXPORT_SLOT_DONE && state.live_workers > 0) {
+                pthread_cond_wait(&state.cond, &state.lock);
+            }
+            /* queued, but every worker has failed */
+            run_inline = slot->state != EXPORT_SLOT_DONE;
+            pthread_mutex_unlock(&state.lock);
+            if (run_inline && export_slot_inline(ctx, &sheet, slot) != 0) {
+                failed = 1;
+                break;
+            }
+            if (write_slot(fd, slot) != 0) {
+                failed = 1;
+                break;
+            }
+            free_slot(ctx, slot);
+            written += 1;
+            if (progress && progress(progress_user, written, num_pages) != 0) {
+                APV_LOG_PRINT(APV_LOG_DEBUG, "export aborted after %d pages", written);
+                break;
+            }
+        }
+
+        /* queue next page */
+        if (i < num_pages) {
+            export_slot_t *slot = &state.slots[i % state.num_slots];
+            int run_inline = 0;
+            load_slot(pdf, slot, first_page + i);
+            pthread_mutex_lock(&state.lock);
+            run_inline = state.live_workers == 0;
+            if (!run_inline) {
+                slot->state = EXPORT_SLOT_QUEUED;
+                state.num_queued = i + 1;
+                pthread_cond_broadcast(&state.cond);
+            }
+            pthread_mutex_unlock(&state.lock);
+            if (run_inline && export_slot_inline(ctx, &sheet, slot) != 0) {
+                failed = 1;
+            }
+        }
+    }
+
+    /* stop workers; slots they are still working on are done after join */
+    pthread_mutex_lock(&state.lock);
+    state.stop = 1;
+    pthread_cond_broadcast(&state.cond);
+    pthread_mutex_unlock(&state.lock);
+    for(i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for(i = 0; i < state.num_slots; ++i) {
+        free_slot(ctx, &state.slots[i]);
+    }
+    free(state.slots);
+    if (sheet) fz_free_text_sheet(ctx, sheet);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+
+    pthread_mutex_lock(&pdf->doc_lock);
+    maybe_free_cache(pdf);
+    pthread_mutex_unlock(&pdf->doc_lock);
+
+    return failed ? -1 : written;
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "apvcore.h"
+
+
+/*
+ * Document fingerprint.
+ *
+ * Cheap identity of document contents, used to key persistent caches, so
+ * that they survive moving and copying the file. Whole file is never read:
+ * fingerprint combines file size, trailer /ID and hashes of sampled blocks -
+ * start of file (header, linearization dictionary and first page trailer),
+ * end of file (last trailer and startxref) and the block where last xref
+ * section starts. Incremental updates and rewrites of a document change at
+ * least one of these.
+ *
+ * Hash is a simple 64 bit multiply-rotate hash over 8 byte words: it's not
+ * cryptographic, but sampled blocks are only a few kB, so fingerprint takes
+ * microseconds regardless of file size.
+ */
+
+
+#define FINGERPRINT_BLOCK_SIZE 4096
+#define FINGERPRINT_MAX_ID_LEN 256
+
+#define FINGERPRINT_PRIME1 0x9e3779b185ebca87ULL
+#define FINGERPRINT_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define FINGERPRINT_PRIME3 0x165667b19e3779f9ULL
+
+
+static unsigned long long rotl64(unsigned long long v, int bits) {
+    return (v << bits) | (v >> (64 - bits));
+}
+
+
+static unsigned long long hash_word(unsigned long long h, unsigned long long v) {
+    v *= FINGERPRINT_PRIME2;
+    v = rotl64(v, 31);
+    v *= FINGERPRINT_PRIME1;
+    h ^= v;
+    return rotl64(h, 27) * FINGERPRINT_PRIME1 + FINGERPRINT_PRIME3;
+}
+
+
+static unsigned long long hash_bytes(unsigned long long h, const unsigned char *data, int len) {
+    unsigned long long v = 0;
+    int n = len;
+    while (n >= 8) {
+        memcpy(&v, data, 8);
+        h = hash_word(h, v);
+        data += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        v = 0;
+        memcpy(&v, data, n);
+        h = hash_word(h, v);
+    }
+    return hash_word(h, (unsigned long long)len);
+}
+
+
+static unsigned long long hash_final(unsigned long long h) {
+    h ^= h >> 33;
+    h *= FINGERPRINT_PRIME2;
+    h ^= h >> 29;
+    h *= FINGERPRINT_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+/**
+ * Read block of stream at given offset.
+ * @return number of bytes read
+ */
+static int read_block(fz_context *ctx, fz_stream *stm, int offset, unsigned char *buf, int len) {
+    int n = 0;
+    fz_try(ctx) {
+        fz_seek(stm, offset, 0);
+        n = fz_read(stm, buf, len);
+    } fz_catch(ctx) {
+        n = 0;
+    }
+    return n < 0 ? 0 : n;
+}
+
+
+/**
+ * Find offset of last xref section in block from end of file.
+ * @return offset or -1 if block has no startxref
+ */
+static int find_startxref(const unsigned char *buf, int len) {
+    static const char keyword[] = "startxref";
+    const int keyword_len = sizeof(keyword) - 1;
+    int i = 0;
+    int ofs = 0;
+    for(i = len - keyword_len; i >= 0; --i) {
+        if (memcmp(buf + i, keyword, keyword_len) == 0) break;
+    }
+    if (i < 0) return -1;
+    i += keyword_len;
+    while (i < len && (buf[i] == ' ' || buf[i] == '\r' || buf[i] == '\n' || buf[i] == '\t')) ++i;
+    if (i == len || buf[i] < '0' || buf[i] > '9') return -1;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9' && ofs < 0x7fffffff / 10) {
+        ofs = ofs * 10 + (buf[i++] - '0');
+    }
+    return ofs;
+}
+
+
+/**
+ * Find raw /ID array of trailer (or xref stream dictionary) in block.
+ * @return 1 if found, *id and *id_len are set to array bytes
+ */
+static int find_id(const unsigned char *buf, int len, const unsigned char **id, int *id_len) {
+    int i = 0;
+    int end = 0;
+    for(i = 0; i + 3 <= len; ++i) {
+        /* /ID followed by delimiter, not /IDTree or such */
+        if (buf[i] == '/' && buf[i+1] == 'I' && buf[i+2] == 'D'
+                && (i + 3 == len || !((buf[i+3] >= 'A' && buf[i+3] <= 'Z') || (buf[i+3] >= 'a' && buf[i+3] <= 'z')))) {
+            break;
+        }
+    }
+    if (i + 3 > len) return 0;
+    for(end = i + 3; end < len && end - i < FINGERPRINT_MAX_ID_LEN && buf[end] != ']'; ++end)
+        ;
+    if (end == len || buf[end] != ']') return 0;
+    *id = buf + i;
+    *id_len = end - i + 1;
+    return 1;
+}
+
+
+/**
+ * Compute fingerprint of document stream.
+ * Stream position is not preserved.
+ * @param size file size
+ * @return 1 if fingerprint was computed
+ */
+int apv_get_fingerprint(fz_context *ctx, fz_stream *stm, long long size, unsigned long long *fingerprint) {
+    unsigned char buf[FINGERPRINT_BLOCK_SIZE];
+    const unsigned char *id = NULL;
+    int id_len = 0;
+    int has_id = 0;
+    unsigned long long h = FINGERPRINT_PRIME1;
+    unsigned long long id_hash = 0;
+    int startxref = -1;
+    int tail_start = 0;
+    int n = 0;
+
+    /* fz_stream offsets are ints */
+    if (size <= 0 || size > 0x7fffffff) return 0;
+
+    h = hash_word(h, (unsigned long long)size);
+
+    tail_start = size > FINGERPRINT_BLOCK_SIZE ? (int)size - FINGERPRINT_BLOCK_SIZE : 0;
+    n = read_block(ctx, stm, tail_start, buf, sizeof(buf));
+    if (n <= 0) return 0;
+    h = hash_bytes(h, buf, n);
+    startxref = find_startxref(buf, n);
+    if (find_id(buf, n, &id, &id_len)) {
+        id_hash = hash_bytes(FINGERPRINT_PRIME2, id, id_len);
+        has_id = 1;
+    }
+
+    if (tail_start > 0) {
+        n = read_block(ctx, stm, 0, buf, sizeof(buf));
+        h = hash_bytes(h, buf, n);
+        if (!has_id && find_id(buf, n, &id, &id_len)) {
+            id_hash = hash_bytes(FINGERPRINT_PRIME2, id, id_len);
+            has_id = 1;
+        }
+    }
+
+    /* xref section that is not in blocks already hashed */
+    if (startxref >= FINGERPRINT_BLOCK_SIZE && startxref < tail_start) {
+        n = read_block(ctx, stm, startxref, buf, sizeof(buf));
+        h = hash_bytes(h, buf, n);
+        if (!has_id && find_id(buf, n, &id, &id_len)) {
+            id_hash = hash_bytes(FINGERPRINT_PRIME2, id, id_len);
+            has_id = 1;
+        }
+    }
+
+    h = hash_word(h, id_hash);
+    *fingerprint = hash_final(h);
+    return 1;
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,566 @@
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "apvcore.h"
+
+#include "mupdf-internal.h"
+
+
+/*
+ * Image decoding ahead of rasterization.
+ *
+ * Draw device decodes images when it reaches them in display list, so images
+ * of one tile are decoded one after another on rendering thread. Before tile
+ * is drawn, its display list is run through a device that only records images
+ * falling into the tile, with the size that draw device will ask for. Larger
+ * of those images are then decoded in parallel, on worker threads with cloned
+ * contexts and on calling thread, into resource store, where draw device finds
+ * them. A tile with several large images then takes about as long as its
+ * largest image.
+ */
+
+
+#define PREDECODE_MAX_WORKERS 4
+#define PREDECODE_MAX_IMAGES 32
+
+/* smaller images are quickly decoded by draw device itself */
+#define PREDECODE_MIN_PIXELS (512 * 512)
+
+
+typedef struct {
+    fz_image *image;
+    int w; /* size as asked for by draw device */
+    int h;
+} predecode_job_t;
+
+
+typedef struct {
+    pthread_mutex_t lock;
+    fz_context *ctx; /* context that worker contexts are cloned from */
+    fz_rect area; /* tile in device space */
+    predecode_job_t jobs[PREDECODE_MAX_IMAGES];
+    int num_jobs;
+    int next_job;
+} predecode_state_t;
+
+
+/**
+ * Queue image for decoding, unless it's small, already decoded or queued.
+ * @param whole if true, image is not going to be decoded only where visible
+ */
+static void add_job(predecode_state_t *state, fz_image *image, const fz_matrix *ctm, int whole) {
+    fz_context *ctx = state->ctx;
+    fz_matrix inverse;
+    fz_rect area;
+    int w = 0;
+    int h = 0;
+    int i = 0;
+
+    if (image->buffer == NULL || image->w == 0 || image->h == 0) return;
+    if ((long long)image->w * image->h < PREDECODE_MIN_PIXELS) return;
+    if (state->num_jobs == PREDECODE_MAX_IMAGES) return;
+
+    /* same size computation as in draw device */
+    w = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+    h = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+
+    if (!whole) {
+        area = state->area;
+        fz_expand_rect(&area, 2);
+        fz_transform_rect(&area, fz_invert_matrix(&inverse, ctm));
+        if (fz_image_wants_area(ctx, image, w, h, &area)) return;
+    }
+
+    for(i = 0; i < state->num_jobs; ++i) {
+        if (state->jobs[i].image == image && state->jobs[i].w == w && state->jobs[i].h == h) return;
+    }
+    state->jobs[state->num_jobs].image = fz_keep_image(ctx, image);
+    state->jobs[state->num_jobs].w = w;
+    state->jobs[state->num_jobs].h = h;
+    state->num_jobs++;
+}
+
+
+static void collect_fill_image(fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha) {
+    add_job(dev->user, image, ctm, 0);
+}
+
+
+static void collect_fill_image_mask(fz_device *dev, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    add_job(dev->user, image, ctm, 1);
+}
+
+
+static void collect_clip_image_mask(fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm) {
+    add_job(dev->user, image, ctm, 1);
+}
+
+
+/**
+ * Decode queued images until there are none left, never throws.
+ * Decoded images stay in resource store.
+ */
+static void run_jobs(fz_context *ctx, predecode_state_t *state) {
+    predecode_job_t *job = NULL;
+    fz_pixmap *pixmap = NULL;
+    while(1) {
+        pthread_mutex_lock(&state->lock);
+        job = state->next_job < state->num_jobs ? &state->jobs[state->next_job++] : NULL;
+        pthread_mutex_unlock(&state->lock);
+        if (job == NULL) break;
+        fz_try(ctx) {
+            pixmap = fz_image_to_pixmap(ctx, job->image, job->w, job->h);
+            fz_drop_pixmap(ctx, pixmap);
+        } fz_catch(ctx) {
+            /* draw device tries again and reports it */
+        }
+    }
+}
+
+
+/**
+ * Worker thread main routine.
+ */
+static void *predecode_worker(void *arg) {
+    predecode_state_t *state = arg;
+    fz_context *ctx = NULL;
+
+    ctx = fz_clone_context(state->ctx);
+    if (ctx == NULL) {
+        APV_LOG_PRINT(APV_LOG_ERROR, "failed to clone fitz context");
+        return NULL;
+    }
+    run_jobs(ctx, state);
+    fz_free_context(ctx);
+    return NULL;
+}
+
+
+/**
+ * Decode images of display list that fall into area, in parallel.
+ * Does nothing unless there are at least two images worth decoding.
+ * @param ctx context of calling thread
+ * @param ctm and area as they will be used to draw the list
+ */
+void predecode_images(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, const fz_rect *area) {
+    predecode_state_t state;
+    pthread_t workers[PREDECODE_MAX_WORKERS];
+    fz_device *dev = NULL;
+    long cpus = 0;
+    int num_workers = 0;
+    int i = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.ctx = ctx;
+    state.area = *area;
+
+    fz_var(dev);
+
+    fz_try(ctx) {
+        dev = fz_new_device(ctx, &state);
+        dev->fill_image = collect_fill_image;
+        dev->fill_image_mask = collect_fill_image_mask;
+        dev->clip_image_mask = collect_clip_image_mask;
+        fz_run_display_list(list, dev, ctm, area, NULL);
+    } fz_always(ctx) {
+        if (dev) fz_free_device(dev);
+    } fz_catch(ctx) {
+        /* decode what was found so far */
+    }
+
+    if (state.num_jobs >= 2) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = MIN(MIN(cpus, PREDECODE_MAX_WORKERS), state.num_jobs) - 1;
+        pthread_mutex_init(&state.lock, NULL);
+        for(i = 0; i < num_workers; ++i) {
+            if (pthread_create(&workers[i], NULL, predecode_worker, &state) != 0) {
+                APV_LOG_PRINT(APV_LOG_WARN, "failed to start image decoding worker %d", i);
+                break;
+            }
+        }
+        num_workers = i;
+        APV_LOG_PRINT(APV_LOG_DEBUG, "decoding %d images on %d threads", state.num_jobs, num_workers + 1);
+        run_jobs(ctx, &state);
+        for(i = 0; i < num_workers; ++i) {
+            pthread_join(workers[i], NULL);
+        }
+        pthread_mutex_destroy(&state.lock);
+    }
+
+    for(i = 0; i < state.num_jobs; ++i) {
+        fz_drop_image(ctx, state.jobs[i].image);
+    }
+}
+
+
+/*
+ * Image level of detail.
+ *
+ * Tiles rendered while view is flung don't need full quality images, they are
+ * replaced as soon as scrolling stops. Image detail device passes everything
+ * to draw device, but images are drawn as placeholder boxes or decoded at
+ * reduced resolution, see APV_IMAGES_* levels.
+ */
+
+
+/* reduced images are decoded at 1/8 of their resolution (or less if drawn smaller) */
+#define LOW_DETAIL_L2FACTOR 3
+
+/* smaller images are drawn with full detail even when reduced detail is asked for */
+#define LOW_DETAIL_MIN_PIXELS (256 * 256)
+
+/* gray level of placeholder boxes */
+#define PLACEHOLDER_GRAY 0.85f
+
+
+typedef struct {
+    fz_device *target;
+    int image_detail;
+    int *reduced; /* incremented for every image drawn with less than full detail */
+} image_detail_state_t;
+
+
+/**
+ * Check if image can be decoded at reduced resolution without decoding it whole first.
+ */
+static int can_decode_reduced(fz_image *image) {
+    if (image->buffer == NULL) return 0;
+    return image->buffer->params.type == FZ_IMAGE_JPEG || image->buffer->params.type == FZ_IMAGE_JPX;
+}
+
+
+/**
+ * Create unit square path, which is what images are drawn into.
+ */
+static fz_path *new_unit_square(fz_context *ctx) {
+    fz_path *path = fz_new_path(ctx);
+    fz_moveto(ctx, path, 0, 0);
+    fz_lineto(ctx, path, 1, 0);
+    fz_lineto(ctx, path, 1, 1);
+    fz_lineto(ctx, path, 0, 1);
+    fz_closepath(ctx, path);
+    return path;
+}
+
+
+/**
+ * Draw placeholder box in place of image.
+ */
+static void fill_placeholder(fz_device *dev, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    fz_context *ctx = dev->ctx;
+    image_detail_state_t *state = dev->user;
+    fz_path *path = new_unit_square(ctx);
+    fz_try(ctx) {
+        fz_fill_path(state->target, path, 0, ctm, colorspace, color, alpha);
+    } fz_always(ctx) {
+        fz_free_path(ctx, path);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+/**
+ * Get image decoded at reduced resolution, wrapped in new image, so that draw
+ * device scales it as usual.
+ * @return reduced image, or NULL if it wouldn't be cheaper to decode than the original
+ */
+static fz_image *new_low_detail_image(fz_context *ctx, fz_image *image, const fz_matrix *ctm) {
+    fz_image *mask = NULL;
+    fz_image *reduced = NULL;
+    fz_pixmap *pixmap = NULL;
+    int w = 0;
+    int h = 0;
+
+    /* same size computation as in draw device */
+    w = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+    h = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+    if (w <= image->w >> LOW_DETAIL_L2FACTOR && h <= image->h >> LOW_DETAIL_L2FACTOR) return NULL;
+    w = MAX(1, MIN(w, image->w >> LOW_DETAIL_L2FACTOR));
+    h = MAX(1, MIN(h, image->h >> LOW_DETAIL_L2FACTOR));
+
+    fz_var(mask);
+    fz_var(pixmap);
+    fz_var(reduced);
+
+    fz_try(ctx) {
+        if (image->mask) {
+            mask = new_low_detail_image(ctx, image->mask, ctm);
+            if (mask == NULL) mask = fz_keep_image(ctx, image->mask);
+        }
+        pixmap = fz_image_to_pixmap(ctx, image, w, h);
+        /* takes pixmap and mask, but not pixmap's colorspace */
+        reduced = fz_new_image_from_pixmap(ctx, pixmap, mask);
+        fz_keep_colorspace(ctx, reduced->colorspace);
+    } fz_catch(ctx) {
+        if (reduced == NULL) {
+            fz_drop_pixmap(ctx, pixmap);
+            /* mask is dropped by fz_new_image_from_pixmap */
+            if (pixmap == NULL) fz_drop_image(ctx, mask);
+        }
+        fz_rethrow(ctx);
+    }
+    return reduced;
+}
+
+
+/**
+ * Decide how image is drawn.
+ * @param reduced receives reduced image for APV_IMAGES_LOW
+ * @return image detail level used for this image
+ */
+static int get_image_detail(fz_device *dev, fz_image *image, const fz_matrix *ctm, fz_image **reduced) {
+    image_detail_state_t *state = dev->user;
+    int detail = state->image_detail;
+
+    *reduced = NULL;
+    if (detail == APV_IMAGES_LOW) {
+        if (image->buffer == NULL || (long long)image->w * image->h < LOW_DETAIL_MIN_PIXELS) {
+            detail = APV_IMAGES_FULL; /* already decoded or cheap to decode */
+        } else if (!can_decode_reduced(image) || (image->mask && !can_decode_reduced(image->mask))) {
+            detail = APV_IMAGES_PLACEHOLDER;
+        } else {
+            fz_try(dev->ctx) {
+                *reduced = new_low_detail_image(dev->ctx, image, ctm);
+            } fz_catch(dev->ctx) {
+                detail = APV_IMAGES_PLACEHOLDER;
+            }
+            if (detail == APV_IMAGES_LOW && *reduced == NULL) detail = APV_IMAGES_FULL;
+        }
+    }
+    if (detail != APV_IMAGES_FULL) (*state->reduced)++;
+    return detail;
+}
+
+
+static void detail_fill_path(fz_device *dev, fz_path *path, int even_odd, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    fz_fill_path(((image_detail_state_t*)dev->user)->target, path, even_odd, ctm, colorspace, color, alpha);
+}
+
+
+static void detail_stroke_path(fz_device *dev, fz_path *path, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    fz_stroke_path(((image_detail_state_t*)dev->user)->target, path, stroke, ctm, colorspace, color, alpha);
+}
+
+
+static void detail_clip_path(fz_device *dev, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm) {
+    fz_clip_path(((image_detail_state_t*)dev->user)->target, path, rect, even_odd, ctm);
+}
+
+
+static void detail_clip_stroke_path(fz_device *dev, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm) {
+    fz_clip_stroke_path(((image_detail_state_t*)dev->user)->target, path, rect, stroke, ctm);
+}
+
+
+static void detail_fill_text(fz_device *dev, fz_text *text, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    fz_fill_text(((image_detail_state_t*)dev->user)->target, text, ctm, colorspace, color, alpha);
+}
+
+
+static void detail_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    fz_stroke_text(((image_detail_state_t*)dev->user)->target, text, stroke, ctm, colorspace, color, alpha);
+}
+
+
+static void detail_clip_text(fz_device *dev, fz_text *text, const fz_matrix *ctm, int accumulate) {
+    fz_clip_text(((image_detail_state_t*)dev->user)->target, text, ctm, accumulate);
+}
+
+
+static void detail_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm) {
+    fz_clip_stroke_text(((image_detail_state_t*)dev->user)->target, text, stroke, ctm);
+}
+
+
+static void detail_ignore_text(fz_device *dev, fz_text *text, const fz_matrix *ctm) {
+    fz_ignore_text(((image_detail_state_t*)dev->user)->target, text, ctm);
+}
+
+
+static void detail_fill_shade(fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha) {
+    fz_fill_shade(((image_detail_state_t*)dev->user)->target, shade, ctm, alpha);
+}
+
+
+static void detail_fill_image(fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha) {
+    image_detail_state_t *state = dev->user;
+    fz_image *reduced = NULL;
+    float gray = PLACEHOLDER_GRAY;
+
+    switch(get_image_detail(dev, image, ctm, &reduced)) {
+        case APV_IMAGES_FULL:
+            fz_fill_image(state->target, image, ctm, alpha);
+            break;
+        case APV_IMAGES_LOW:
+            fz_try(dev->ctx) {
+                fz_fill_image(state->target, reduced, ctm, alpha);
+            } fz_always(dev->ctx) {
+                fz_drop_image(dev->ctx, reduced);
+            } fz_catch(dev->ctx) {
+                fz_rethrow(dev->ctx);
+            }
+            break;
+        default:
+            fill_placeholder(dev, ctm, fz_device_gray(dev->ctx), &gray, alpha);
+            break;
+    }
+}
+
+
+static void detail_fill_image_mask(fz_device *dev, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha) {
+    image_detail_state_t *state = dev->user;
+    fz_image *reduced = NULL;
+
+    switch(get_image_detail(dev, image, ctm, &reduced)) {
+        case APV_IMAGES_FULL:
+            fz_fill_image_mask(state->target, image, ctm, colorspace, color, alpha);
+            break;
+        case APV_IMAGES_LOW:
+            fz_try(dev->ctx) {
+                fz_fill_image_mask(state->target, reduced, ctm, colorspace, color, alpha);
+            } fz_always(dev->ctx) {
+                fz_drop_image(dev->ctx, reduced);
+            } fz_catch(dev->ctx) {
+                fz_rethrow(dev->ctx);
+            }
+            break;
+        default:
+            /* mask is mostly transparent, so box in its colour would be too dark */
+            fill_placeholder(dev, ctm, colorspace, color, alpha / 4);
+            break;
+    }
+}
+
+
+static void detail_clip_image_mask(fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm) {
+    image_detail_state_t *state = dev->user;
+    fz_image *reduced = NULL;
+    fz_path *path = NULL;
+
+    switch(get_image_detail(dev, image, ctm, &reduced)) {
+        case APV_IMAGES_FULL:
+            fz_clip_image_mask(state->target, image, rect, ctm);
+            break;
+        case APV_IMAGES_LOW:
+            fz_try(dev->ctx) {
+                fz_clip_image_mask(state->target, reduced, rect, ctm);
+            } fz_always(dev->ctx) {
+                fz_drop_image(dev->ctx, reduced);
+            } fz_catch(dev->ctx) {
+                fz_rethrow(dev->ctx);
+            }
+            break;
+        default:
+            /* clip to image bounds, so that clip stack stays the same */
+            path = new_unit_square(dev->ctx);
+            fz_try(dev->ctx) {
+                fz_clip_path(state->target, path, rect, 0, ctm);
+            } fz_always(dev->ctx) {
+                fz_free_path(dev->ctx, path);
+            } fz_catch(dev->ctx) {
+                fz_rethrow(dev->ctx);
+            }
+            break;
+    }
+}
+
+
+static void detail_pop_clip(fz_device *dev) {
+    fz_pop_clip(((image_detail_state_t*)dev->user)->target);
+}
+
+
+static void detail_begin_mask(fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *bc) {
+    fz_begin_mask(((image_detail_state_t*)dev->user)->target, rect, luminosity, colorspace, bc);
+}
+
+
+static void detail_end_mask(fz_device *dev) {
+    fz_end_mask(((image_detail_state_t*)dev->user)->target);
+}
+
+
+static void detail_begin_group(fz_device *dev, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha) {
+    fz_begin_group(((image_detail_state_t*)dev->user)->target, rect, isolated, knockout, blendmode, alpha);
+}
+
+
+static void detail_end_group(fz_device *dev) {
+    fz_end_group(((image_detail_state_t*)dev->user)->target);
+}
+
+
+static int detail_begin_tile(fz_device *dev, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id) {
+    return fz_begin_tile_id(((image_detail_state_t*)dev->user)->target, area, view, xstep, ystep, ctm, id);
+}
+
+
+static void detail_end_tile(fz_device *dev) {
+    fz_end_tile(((image_detail_state_t*)dev->user)->target);
+}
+
+
+static void detail_free_user(fz_device *dev) {
+    fz_free(dev->ctx, dev->user);
+}
+
+
+/**
+ * Create device that draws to target device with given image detail.
+ * Target device is not freed with returned device.
+ * @param image_detail APV_IMAGES_PLACEHOLDER or APV_IMAGES_LOW; APV_IMAGES_SKIP
+ * is done by target hints and APV_IMAGES_FULL needs no wrapping
+ * @param reduced incremented for every image drawn with less than full detail
+ */
+fz_device *new_image_detail_device(fz_context *ctx, fz_device *target, int image_detail, int *reduced) {
+    image_detail_state_t *state = NULL;
+    fz_device *dev = NULL;
+
+    state = fz_malloc_struct(ctx, image_detail_state_t);
+    state->target = target;
+    state->image_detail = image_detail;
+    state->reduced = reduced;
+
+    fz_try(ctx) {
+        dev = fz_new_device(ctx, state);
+    } fz_catch(ctx) {
+        fz_free(ctx, state);
+        fz_rethrow(ctx);
+    }
+    dev->hints = target->hints;
+    dev->flags = target->flags;
+    dev->free_user = detail_free_user;
+
+    dev->fill_path = detail_fill_path;
+    dev->stroke_path = detail_stroke_path;
+    dev->clip_path = detail_clip_path;
+    dev->clip_stroke_path = detail_clip_stroke_path;
+
+    dev->fill_text = detail_fill_text;
+    dev->stroke_text = detail_stroke_text;
+    dev->clip_text = detail_clip_text;
+    dev->clip_stroke_text = detail_clip_stroke_text;
+    dev->ignore_text = detail_ignore_text;
+
+    dev->fill_shade = detail_fill_shade;
+    dev->fill_image = detail_fill_image;
+    dev->fill_image_mask = detail_fill_image_mask;
+    dev->clip_image_mask = detail_clip_image_mask;
+
+    dev->pop_clip = detail_pop_clip;
+
+    dev->begin_mask = detail_begin_mask;
+    dev->end_mask = detail_end_mask;
+    dev->begin_group = detail_begin_group;
+    dev->end_group = detail_end_group;
+
+    dev->begin_tile = detail_begin_tile;
+    dev->end_tile = detail_end_tile;
+
+    return dev;
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,48 @@
+#ifdef APVJNI_H__
+#error APVJNI_H__ can be included only once
+#endif
+
+#define APVJNI_H__
+
+
+#include <jni.h>
+
+
+/**
+ * Java classes, methods and fields used by native code.
+ * Resolved once in JNI_OnLoad, classes are held as global refs so ids stay valid.
+ */
+typedef struct {
+    jclass pdf_class;
+    jfieldID pdf_ptr_field_id;
+    jfieldID pdf_invalid_password_field_id;
+    jmethodID pdf_get_font_data_method_id;
+    jmethodID pdf_get_cmap_data_method_id;
+
+    jclass size_class;
+    jfieldID size_width_field_id;
+    jfieldID size_height_field_id;
+
+    jclass find_result_class;
+    jmethodID find_result_constructor_id;
+    jfieldID find_result_page_field_id;
+    jmethodID find_result_add_marker_method_id;
+
+    jclass array_list_class;
+    jmethodID array_list_constructor_id;
+    jmethodID array_list_add_method_id;
+
+    jclass file_descriptor_class;
+    jfieldID file_descriptor_descriptor_field_id;
+
+    jclass export_progress_listener_class;
+    jmethodID export_progress_listener_on_export_progress_method_id;
+} apv_jni_ids_t;
+
+
+/* defined in apvandroid.c */
+extern apv_jni_ids_t apv_jni_ids;
+JavaVM *apv_get_cached_jvm();
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "apvcore.h"
+
+#include "mupdf-internal.h"
+
+
+/*
+ * Memory mapped document input.
+ *
+ * Whole file is mapped read only and stream buffer pointers (bp, rp, wp, ep)
+ * point straight into the mapping, so lexer and filters read mapped pages
+ * without read() calls or copies, and seek is just pointer arithmetic.
+ * Stream never needs refilling - read callback always reports end of data.
+ *
+ * If file is truncated while mapped, touching pages past its new end raises
+ * SIGBUS. Mappings are registered with process wide SIGBUS handler, which maps
+ * zero pages over the rest of faulting mapping and flags it as truncated, so
+ * faulting read sees zeros instead of crashing the app. Stream callbacks then
+ * throw and apv_is_truncated_stream reports the flag, page interpretation
+ * checks it so that garbage parsed from zeros doesn't end up rendered.
+ * Truncation inside last page isn't noticed, kernel zero-fills it anyway.
+ *
+ * If file can't be mapped (empty, too large for fz_stream offsets, mmap
+ * failure, all mapping slots in use), documents are read through regular
+ * buffered fz_open_fd stream.
+ *
+ * Descriptors that can't be seeked (pipes from content providers) are read
+ * through spill stream: source is read sequentially, only as far as parser
+ * asks, and appended in chunks to unlinked temporary file in cache dir, which
+ * then serves all reads and seeks. Seeking to the end still has to read whole
+ * source, but nothing is read twice.
+ */
+
+
+/* bytes appended to spill file at once */
+#define SPILL_CHUNK_SIZE (64 * 1024)
+/* stream buffer refilled from spill file */
+#define SPILL_READ_SIZE (16 * 1024)
+/* mapped files open at once, more are read through fz_open_fd */
+#define MAX_MAPPINGS 16
+
+
+/**
+ * Mapping watched by SIGBUS handler.
+ * Slot is free when data is NULL; len is set before data is published.
+ */
+typedef struct {
+    unsigned char * volatile data;
+    volatile size_t len;
+    volatile int truncated;
+} apv_mapping_t;
+
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    apv_mapping_t *mapping;
+} apv_mapped_state_t;
+
+
+static apv_mapping_t mappings[MAX_MAPPINGS];
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+static struct sigaction old_sigbus;
+static int sigbus_installed = 0;
+static size_t page_size = 4096;
+
+
+/**
+ * SIGBUS handler: if fault is inside registered mapping, replace its pages from
+ * faulting one to the end with zero pages, flag it and retry the access.
+ * Other faults go to previously installed handler.
+ */
+static void sigbus_handler(int sig, siginfo_t *info, void *context) {
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    int i = 0;
+
+    for(i = 0; i < MAX_MAPPINGS; ++i) {
+        uintptr_t start = (uintptr_t)mappings[i].data;
+        uintptr_t end = start + mappings[i].len;
+        /* MAP_FAILED marks slot being registered */
+        if (start != 0 && start != (uintptr_t)MAP_FAILED && addr >= start && addr < end) {
+            uintptr_t page = addr & ~(uintptr_t)(page_size - 1);
+            end = (end + page_size - 1) & ~(uintptr_t)(page_size - 1);
+            if (mmap((void*)page, end - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+                mappings[i].truncated = 1;
+                return;
+            }
+            break;
+        }
+    }
+
+    if (old_sigbus.sa_flags & SA_SIGINFO) {
+        old_sigbus.sa_sigaction(sig, info, context);
+    } else if (old_sigbus.sa_handler == SIG_DFL || old_sigbus.sa_handler == SIG_IGN) {
+        /* faulting access is retried on return and dies with default action,
+         * sent signal has to be raised again */
+        sigaction(SIGBUS, &old_sigbus, NULL);
+        if (info->si_code <= 0)
+            raise(sig);
+    } else {
+        old_sigbus.sa_handler(sig);
+    }
+}
+
+
+static void install_sigbus_handler(void) {
+    struct sigaction sa;
+    long size = sysconf(_SC_PAGESIZE);
+    if (size > 0) page_size = (size_t)size;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigbus_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &old_sigbus) == 0) {
+        sigbus_installed = 1;
+    } else {
+        APV_LOG_PRINT(APV_LOG_WARN, "failed to install SIGBUS handler: %s", strerror(errno));
+    }
+}
+
+
+/**
+ * Register mapping with SIGBUS handler.
+ * @return slot or NULL if handler can't be installed or all slots are in use
+ */
+static apv_mapping_t *register_mapping(unsigned char *data, size_t len) {
+    int i = 0;
+    pthread_once(&sigbus_once, install_sigbus_handler);
+    if (!sigbus_installed) return NULL;
+    for(i = 0; i < MAX_MAPPINGS; ++i) {
+        /* claim slot with placeholder, then publish mapping once len is set */
+        if (__sync_bool_compare_and_swap(&mappings[i].data, NULL, (unsigned char*)MAP_FAILED)) {
+            mappings[i].len = len;
+            mappings[i].truncated = 0;
+            __sync_synchronize();
+            mappings[i].data = data;
+            return &mappings[i];
+        }
+    }
+    APV_LOG_PRINT(APV_LOG_WARN, "all %d mapping slots are in use", MAX_MAPPINGS);
+    return NULL;
+}
+
+
+static void unregister_mapping(apv_mapping_t *mapping) {
+    __sync_synchronize();
+    mapping->data = NULL;
+    __sync_synchronize();
+}
+
+
+static void check_mapped(fz_stream *stm) {
+    apv_mapped_state_t *state = (apv_mapped_state_t*)stm->state;
+    if (state->mapping->truncated)
+        fz_throw(stm->ctx, "file was truncated while open");
+}
+
+
+static int read_mapped(fz_stream *stm, unsigned char *buf, int len) {
+    check_mapped(stm);
+    return 0;
+}
+
+
+static void seek_mapped(fz_stream *stm, int offset, int whence) {
+    check_mapped(stm);
+    if (whence == 0)
+        stm->rp = stm->bp + offset;
+    if (whence == 1)
+        stm->rp += offset;
+    if (whence == 2)
+        stm->rp = stm->ep - offset;
+    stm->rp = fz_clampp(stm->rp, stm->bp, stm->ep);
+    stm->wp = stm->ep;
+}
+
+
+static void close_mapped(fz_context *ctx, void *state_) {
+    apv_mapped_state_t *state = (apv_mapped_state_t*)state_;
+    unregister_mapping(state->mapping);
+    if (munmap(state->data, state->len) != 0)
+        fz_warn(ctx, "munmap error: %s", strerror(errno));
+    fz_free(ctx, state);
+}
+
+
+typedef struct {
+    int src; /* source descriptor, read sequentially */
+    int spill; /* unlinked temporary file holding bytes read from src */
+    int cached; /* number of bytes in spill */
+    int src_eof;
+    int pos; /* position of stream buffer end (stm->wp) */
+    unsigned char buf[SPILL_READ_SIZE];
+    unsigned char chunk[SPILL_CHUNK_SIZE];
+} apv_spill_state_t;
+
+
+/**
+ * Read next chunk of source and append it to spill file.
+ */
+static void spill_chunk(fz_context *ctx, apv_spill_state_t *state) {
+    int n = 0;
+    int len = 0;
+    int w = 0;
+    /* fz_stream positions are ints */
+    if (state->cached > 0x7fffffff - SPILL_CHUNK_SIZE)
+        fz_throw(ctx, "spilled stream is too long");
+    do {
+        n = read(state->src, state->chunk + len, SPILL_CHUNK_SIZE - len);
+        if (n > 0) len += n;
+    } while ((n > 0 && len < SPILL_CHUNK_SIZE) || (n < 0 && errno == EINTR));
+    if (n < 0)
+        fz_throw(ctx, "read error: %s", strerror(errno));
+    if (n == 0)
+        state->src_eof = 1;
+    while (w < len) {
+        n = pwrite(state->spill, state->chunk + w, len - w, state->cached + w);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+            fz_throw(ctx, "spill file write error: %s", strerror(errno));
+        w += n;
+    }
+    state->cached += len;
+}
+
+
+static int read_spilled(fz_stream *stm, unsigned char *buf, int len) {
+    apv_spill_state_t *state = (apv_spill_state_t*)stm->state;
+    int n = 0;
+    while (state->cached - state->pos < len && !state->src_eof) {
+        spill_chunk(stm->ctx, state);
+    }
+    len = fz_mini(len, state->cached - state->pos);
+    if (len <= 0) return 0;
+    do {
+        n = pread(state->spill, buf, len, state->pos);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        fz_throw(stm->ctx, "spill file read error: %s", strerror(errno));
+    state->pos += n;
+    return n;
+}
+
+
+static void seek_spilled(fz_stream *stm, int offset, int whence) {
+    apv_spill_state_t *state = (apv_spill_state_t*)stm->state;
+    if (whence == 2) {
+        while (!state->src_eof) {
+            spill_chunk(stm->ctx, state);
+        }
+        offset = state->cached - offset;
+    }
+    /* fz_seek turns whence 1 into 0 */
+    if (offset < 0)
+        offset = 0;
+    if (offset > state->cached) {
+        while (state->cached < offset && !state->src_eof) {
+            spill_chunk(stm->ctx, state);
+        }
+        offset = fz_mini(offset, state->cached);
+    }
+    state->pos = offset;
+    stm->pos = offset;
+    stm->rp = stm->bp;
+    stm->wp = stm->bp;
+}
+
+
+static void close_spilled(fz_context *ctx, void *state_) {
+    apv_spill_state_t *state = (apv_spill_state_t*)state_;
+    close(state->spill);
+    if (close(state->src) != 0)
+        fz_warn(ctx, "close error: %s", strerror(errno));
+    fz_free(ctx, state);
+}
+
+
+/**
+ * Open stream that spills non-seekable fd to temporary file.
+ * Takes ownership of fd on success.
+ * @return stream or NULL if temporary file can't be created
+ */
+static fz_stream *open_spilled_fd(fz_context *ctx, int fd) {
+    fz_stream *stm = NULL;
+    apv_spill_state_t *state = NULL;
+    int spill = apv_create_temp_file();
+
+    if (spill == -1) return NULL;
+
+    fz_try(ctx) {
+        state = fz_malloc_struct(ctx, apv_spill_state_t);
+    } fz_catch(ctx) {
+        close(spill);
+        fz_rethrow(ctx);
+    }
+    state->src = fd;
+    state->spill = spill;
+
+    /* fz_new_stream calls close_spilled on failure */
+    stm = fz_new_stream(ctx, state, read_spilled, close_spilled);
+    stm->seek = seek_spilled;
+
+    /* refill from spill file in larger blocks than fz_stream buffer */
+    stm->bp = state->buf;
+    stm->rp = state->buf;
+    stm->wp = state->buf;
+    stm->ep = state->buf + SPILL_READ_SIZE;
+
+    APV_LOG_PRINT(APV_LOG_DEBUG, "reading fd %d through spill file", fd);
+    return stm;
+}
+
+
+/**
+ * Map whole file open as fd.
+ * @return mapping or MAP_FAILED if file can't be mapped
+ */
+static unsigned char *map_fd(int fd, size_t *len) {
+    struct stat st;
+    void *data;
+
+    if (fstat(fd, &st) != 0) {
+        APV_LOG_PRINT(APV_LOG_WARN, "fstat(%d) failed: %s", fd, strerror(errno));
+        return MAP_FAILED;
+    }
+    /* fz_stream positions are ints */
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+        return MAP_FAILED;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        APV_LOG_PRINT(APV_LOG_WARN, "mmap(%d, %ld) failed: %s", fd, (long)st.st_size, strerror(errno));
+        return MAP_FAILED;
+    }
+    *len = (size_t)st.st_size;
+    return (unsigned char*)data;
+}
+
+
+/**
+ * Open stream over file descriptor, memory mapped if possible.
+ * Non-seekable descriptors are read through spill file.
+ * Like fz_open_fd, stream takes ownership of fd: it's closed right after mapping,
+ * or when stream is closed in spill and buffered fallbacks.
+ */
+fz_stream *apv_open_mapped_fd(fz_context *ctx, int fd) {
+    fz_stream *stm = NULL;
+    apv_mapped_state_t *state = NULL;
+    apv_mapping_t *mapping = NULL;
+    unsigned char *data = NULL;
+    size_t len = 0;
+
+    data = map_fd(fd, &len);
+    if (data == MAP_FAILED) {
+        if (lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+            stm = open_spilled_fd(ctx, fd);
+            if (stm) return stm;
+        }
+        return fz_open_fd(ctx, fd);
+    }
+
+    /* unwatched mapping would crash the app if file gets truncated */
+    mapping = register_mapping(data, len);
+    if (mapping == NULL) {
+        munmap(data, len);
+        return fz_open_fd(ctx, fd);
+    }
+
+    fz_try(ctx) {
+        state = fz_malloc_struct(ctx, apv_mapped_state_t);
+    } fz_catch(ctx) {
+        unregister_mapping(mapping);
+        munmap(data, len);
+        close(fd);
+        fz_rethrow(ctx);
+    }
+    state->data = data;
+    state->len = len;
+    state->mapping = mapping;
+    /* mapping stays valid after fd is closed */
+    close(fd);
+
+    /* fz_new_stream calls close_mapped on failure */
+    stm = fz_new_stream(ctx, state, read_mapped, close_mapped);
+    stm->seek = seek_mapped;
+
+    stm->bp = data;
+    stm->rp = data;
+    stm->wp = data + len;
+    stm->ep = data + len;
+
+    stm->pos = (int)len;
+
+    return stm;
+}
+
+
+/**
+ * Check if stream is mapped and its file was found truncated while mapped.
+ * Data read from such stream since truncation may be zeros, callers check
+ * after parsing so that results built from them are dropped.
+ */
+int apv_is_truncated_stream(fz_stream *stm) {
+    return stm && stm->read == read_mapped && ((apv_mapped_state_t*)stm->state)->mapping->truncated;
+}
+
+
+/**
+ * Open file by name, memory mapped if possible.
+ */
+fz_stream *apv_open_mapped_file(fz_context *ctx, const char *filename) {
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd == -1)
+        fz_throw(ctx, "cannot open %s", filename);
+    return apv_open_mapped_fd(ctx, fd);
+}
+
+
+/* vim: set sts=4 ts=4 sw=4 et: */
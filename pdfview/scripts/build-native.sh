@@ -42,9 +42,33 @@ done
 echo "patching mupdf"
 cd ..
 patch jni/mupdf/fitz/fitz.h jni/mupdf-apv/fitz/apv_fitz.h.patch
+patch jni/mupdf/fitz/fitz-internal.h jni/mupdf-apv/fitz/apv_fitz-internal.h.patch
+patch jni/mupdf/pdf/mupdf-internal.h jni/mupdf-apv/pdf/apv_mupdf-internal.h.patch
+patch -o jni/mupdf-apv/draw/apv_draw_affine.c jni/mupdf/draw/draw_affine.c jni/mupdf-apv/draw/apv_draw_affine.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_device.c jni/mupdf/draw/draw_device.c jni/mupdf-apv/draw/apv_draw_device.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_edge.c jni/mupdf/draw/draw_edge.c jni/mupdf-apv/draw/apv_draw_edge.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_glyph.c jni/mupdf/draw/draw_glyph.c jni/mupdf-apv/draw/apv_draw_glyph.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_paint.c jni/mupdf/draw/draw_paint.c jni/mupdf-apv/draw/apv_draw_paint.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_path.c jni/mupdf/draw/draw_path.c jni/mupdf-apv/draw/apv_draw_path.c.patch
+patch -o jni/mupdf-apv/draw/apv_draw_scale.c jni/mupdf/draw/draw_scale.c jni/mupdf-apv/draw/apv_draw_scale.c.patch
 patch -o jni/mupdf-apv/fitz/apv_doc_document.c jni/mupdf/fitz/doc_document.c jni/mupdf-apv/fitz/apv_doc_document.c.patch
+patch -o jni/mupdf-apv/fitz/apv_filt_dctd.c jni/mupdf/fitz/filt_dctd.c jni/mupdf-apv/fitz/apv_filt_dctd.c.patch
+patch -o jni/mupdf-apv/fitz/apv_filt_faxd.c jni/mupdf/fitz/filt_faxd.c jni/mupdf-apv/fitz/apv_filt_faxd.c.patch
+patch -o jni/mupdf-apv/fitz/apv_filt_jbig2d.c jni/mupdf/fitz/filt_jbig2d.c jni/mupdf-apv/fitz/apv_filt_jbig2d.c.patch
+patch -o jni/mupdf-apv/fitz/apv_image_jpx.c jni/mupdf/fitz/image_jpx.c jni/mupdf-apv/fitz/apv_image_jpx.c.patch
+patch -o jni/mupdf-apv/fitz/apv_res_image.c jni/mupdf/fitz/res_image.c jni/mupdf-apv/fitz/apv_res_image.c.patch
+patch -o jni/mupdf-apv/fitz/apv_res_store.c jni/mupdf/fitz/res_store.c jni/mupdf-apv/fitz/apv_res_store.c.patch
+patch -o jni/mupdf-apv/fitz/apv_text_extract.c jni/mupdf/fitz/text_extract.c jni/mupdf-apv/fitz/apv_text_extract.c.patch
 patch -o jni/mupdf-apv/pdf/apv_pdf_cmap_table.c jni/mupdf/pdf/pdf_cmap_table.c jni/mupdf-apv/pdf/apv_pdf_cmap_table.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_font.c jni/mupdf/pdf/pdf_font.c jni/mupdf-apv/pdf/apv_pdf_font.c.patch
 patch -o jni/mupdf-apv/pdf/apv_pdf_fontfile.c jni/mupdf/pdf/pdf_fontfile.c jni/mupdf-apv/pdf/apv_pdf_fontfile.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_image.c jni/mupdf/pdf/pdf_image.c jni/mupdf-apv/pdf/apv_pdf_image.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_page.c jni/mupdf/pdf/pdf_page.c jni/mupdf-apv/pdf/apv_pdf_page.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_repair.c jni/mupdf/pdf/pdf_repair.c jni/mupdf-apv/pdf/apv_pdf_repair.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_stream.c jni/mupdf/pdf/pdf_stream.c jni/mupdf-apv/pdf/apv_pdf_stream.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_type3.c jni/mupdf/pdf/pdf_type3.c jni/mupdf-apv/pdf/apv_pdf_type3.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_xref.c jni/mupdf/pdf/pdf_xref.c jni/mupdf-apv/pdf/apv_pdf_xref.c.patch
+patch -o jni/mupdf-apv/pdf/apv_pdf_xref_aux.c jni/mupdf/pdf/pdf_xref_aux.c jni/mupdf-apv/pdf/apv_pdf_xref_aux.c.patch
 cd deps
 
 
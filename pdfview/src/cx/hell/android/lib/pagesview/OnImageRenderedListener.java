@@ -11,4 +11,10 @@ import android.graphics.Bitmap;
 public interface OnImageRenderedListener {
 	void onImagesRendered(Map<Tile,Bitmap> renderedImages);
 	void onRenderingException(RenderingException reason);
+	/**
+	 * Real page sizes are known, replacing estimates returned by
+	 * PagesProvider.getPageSizes. Number of pages can differ from estimate
+	 * if page count of broken file was corrected. May be called from any thread.
+	 */
+	void onPageSizesChanged(int[][] pageSizes);
 }
@@ -18,12 +18,17 @@ public abstract class PagesProvider {
 	/**
 	 * Get page count.
 	 * This cannot change between executions - PagesView assumes (for now) that docuement doesn't change.
+	 * Only exception is wrong page count of broken file, which is corrected
+	 * using onPageSizesChanged, see getPageSizes.
 	 */
 	public abstract int getPageCount();
 	
 	/**
 	 * Get page sizes.
-	 * This cannot change between executions - PagesView assumes (for now) that docuement doesn't change.
+	 * Provider may return estimated sizes to show first page sooner, and then
+	 * pass real sizes to onPageSizesChanged of listener set by
+	 * setOnImageRenderedListener. Real sizes are passed the same way if page
+	 * count turns out to be wrong.
 	 */
 	public abstract int[][] getPageSizes();
 	
@@ -42,6 +47,27 @@ public abstract class PagesProvider {
 	}
 	
 	public abstract void setVisibleTiles(Collection<Tile> tiles);
+	
+	/**
+	 * Hint which pages are likely to become visible soon, so that provider
+	 * can prepare them in background.
+	 * Called on every redraw, often with the same pages.
+	 * Default implementation does nothing.
+	 * @param pages 0-based page numbers, nearest first
+	 */
+	public void setPrefetchPages(int[] pages) {
+		/* to be overridden when needed */
+	}
+	
+	/**
+	 * Tell provider whether view is being flung, so that it can render
+	 * cheaper tiles meanwhile and refine them when scrolling stops.
+	 * Called on every redraw.
+	 * Default implementation does nothing.
+	 */
+	public void setFlinging(boolean flinging) {
+		/* to be overridden when needed */
+	}
 
 	public abstract float getRenderAhead();
 }
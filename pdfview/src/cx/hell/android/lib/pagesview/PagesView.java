@@ -52,6 +52,9 @@ public class PagesView extends View implements
 	private static final int MIN_TILE_HEIGHT = 128;
 	private static final int MAX_TILE_PIXELS = 640*360;
 	
+	/* number of pages after render-ahead window that are prepared for rendering in background */
+	private static final int PREFETCH_PAGES = 2;
+	
 //	private final static int MAX_ZOOM = 4000;
 //	private final static int MIN_ZOOM = 100;
 	
@@ -378,18 +381,7 @@ public class PagesView extends View implements
 		this.pagesProvider = pagesProvider;
 		if (this.pagesProvider != null) {
 			this.pageSizes = this.pagesProvider.getPageSizes();
-			
-			maxRealPageSize[0] = 0f;
-			maxRealPageSize[1] = 0f;
-			realDocumentSize[0] = 0f;
-			realDocumentSize[1] = 0f;
-			
-			for (int i = 0; i < this.pageSizes.length; i++) 
-				for (int j = 0; j<2; j++) {
-					if (pageSizes[i][j] > maxRealPageSize[j])
-						maxRealPageSize[j] = pageSizes[i][j];
-					realDocumentSize[j] += pageSizes[i][j]; 
-				}
+			this.computeRealDocumentSize();
 			
 			if (this.width > 0 && this.height > 0) {
 				this.scaling0 = Math.min(
@@ -404,6 +396,46 @@ public class PagesView extends View implements
 		this.pagesProvider.setOnImageRenderedListener(this);
 	}
 	
+	/**
+	 * Compute max page size and document size from page sizes.
+	 */
+	private void computeRealDocumentSize() {
+		maxRealPageSize[0] = 0f;
+		maxRealPageSize[1] = 0f;
+		realDocumentSize[0] = 0f;
+		realDocumentSize[1] = 0f;
+		
+		for (int i = 0; i < this.pageSizes.length; i++) 
+			for (int j = 0; j<2; j++) {
+				if (pageSizes[i][j] > maxRealPageSize[j])
+					maxRealPageSize[j] = pageSizes[i][j];
+				realDocumentSize[j] += pageSizes[i][j]; 
+			}
+	}
+	
+	/**
+	 * Replace estimated page sizes with real ones.
+	 * Keeps current page at the same place on screen; base scaling is not
+	 * changed, since it depends only on first page, whose size is exact.
+	 * Page count changes only if it was wrong in a broken file, then current
+	 * page is moved to last page if it no longer exists.
+	 */
+	public void onPageSizesChanged(final int[][] pageSizes) {
+		this.post(new Runnable() {
+			public void run() {
+				if (PagesView.this.pageSizes == null || pageSizes.length == 0) return;
+				int page = Math.min(Math.max(PagesView.this.currentPage, 0), pageSizes.length - 1);
+				Point before = getPagePositionInDocumentWithZoom(page);
+				if (PagesView.this.currentPage >= pageSizes.length) PagesView.this.currentPage = page;
+				PagesView.this.pageSizes = pageSizes;
+				computeRealDocumentSize();
+				Point after = getPagePositionInDocumentWithZoom(page);
+				PagesView.this.top += after.y - before.y;
+				invalidate();
+			}
+		});
+	}
+	
 	/**
 	 * Draw view.
 	 * @param canvas what to draw on
@@ -522,8 +554,11 @@ public class PagesView extends View implements
 	
 	@Override
 	public void computeScroll() {
-		if (this.scroller == null) 
+		if (this.scroller == null) {
+			if (this.pagesProvider != null)
+				this.pagesProvider.setFlinging(false);
 			return;
+		}
 		
 		if (this.scroller.computeScrollOffset()) {
 			left = this.scroller.getCurrX();
@@ -531,6 +566,9 @@ public class PagesView extends View implements
 			((cx.hell.android.pdfview.OpenFileActivity)activity).showPageNumber(false);
 			postInvalidate();
 		}
+		/* set before tiles of this frame are requested, so that last frame of fling asks for full ones */
+		if (this.pagesProvider != null)
+			this.pagesProvider.setFlinging(!this.scroller.isFinished());
 	}
 	
 	/**
@@ -602,6 +640,7 @@ public class PagesView extends View implements
 			float currpageoff = currentMarginY;
 
 			this.currentPage = -1;
+			int lastPage = -1;
 			
 			pagey0 = 0;
 			int[] tileSizes = new int[2];
@@ -629,6 +668,7 @@ public class PagesView extends View implements
 						// remember the currently displayed page
 						this.currentPage = i;
 					}
+					lastPage = i;
 									
 					x = (int)pagex0 - viewx0 - adjScreenLeft;
 					y = (int)pagey0 - viewy0 - adjScreenTop;
@@ -692,6 +732,14 @@ public class PagesView extends View implements
 				currpageoff += currentMarginY + this.getCurrentPageHeight(i);
 			}
 			this.pagesProvider.setVisibleTiles(visibleTiles);
+			
+			if (!mtZoomActive && lastPage != -1) {
+				int prefetchCount = Math.min(PREFETCH_PAGES, pageCount - lastPage - 1);
+				int[] prefetchPages = new int[prefetchCount];
+				for(int i = 0; i < prefetchCount; ++i)
+					prefetchPages[i] = lastPage + 1 + i;
+				this.pagesProvider.setPrefetchPages(prefetchPages);
+			}
 		}
 	}
 	
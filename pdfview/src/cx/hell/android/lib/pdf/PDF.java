@@ -81,8 +81,21 @@ public class PDF {
 
     public static native void init(int maxStore);
     
+	/**
+	 * Set directory where native code keeps cached xref and page info of
+	 * opened documents, so they reopen faster, and spills documents read from
+	 * non-seekable descriptors (pipes). Null disables both.
+	 */
+	public static native void setCacheDir(String dir);
+	
     public static void setApplicationContext(Context context) {
         PDF.applicationContext = context;
+        File cacheDir = new File(context.getCacheDir(), "pdf");
+        if (cacheDir.isDirectory() || cacheDir.mkdirs()) {
+            PDF.setCacheDir(cacheDir.getAbsolutePath());
+        } else {
+            Log.w(TAG, "can't create cache dir " + cacheDir);
+        }
     }
 	
     public static byte[] getFontData(String name) {
@@ -202,6 +215,17 @@ public class PDF {
 		}
 	}
 	
+	/**
+	 * Receives text export progress from native code.
+	 */
+	public static interface ExportProgressListener {
+		/**
+		 * Called after each exported page.
+		 * @return false to abort export
+		 */
+		boolean onExportProgress(int pagesDone, int pagesTotal);
+	}
+	
 	// #ifdef pro
 // 	/**
 // 	 * Java version of fz_outline.
@@ -385,10 +409,93 @@ public class PDF {
 		this.parseFileDescriptor(file.getFileDescriptor(), box, "");
 	}
 	
+	/*
+	 * Methods that use parsed document are not synchronized: native code locks
+	 * document by itself, so rendering, search and page size queries can run
+	 * concurrently from different threads.
+	 */
+
 	/**
 	 * Return page count from pdf_t struct.
 	 */
-	synchronized public native int getPageCount();
+	public native int getPageCount();
+	
+	/**
+	 * Check if first page can be rendered before sizes of other pages are known.
+	 * True for linearized ("fast web view") files until something needs
+	 * page tree, and for large documents whose page sizes are not cached yet;
+	 * their pages are looked up in page tree lazily.
+	 */
+	public native boolean hasFastFirstPage();
+	
+	/**
+	 * Get identity of document contents for keying persistent caches.
+	 * It doesn't change when file is moved or copied and is computed from
+	 * a few sampled blocks, so it's cheap even for huge files.
+	 * @return 16 hex digits or null if file is not a regular file
+	 */
+	public native String getFingerprint();
+	
+	/**
+	 * Phases of opening document, see getOpenStats.
+	 */
+	public final static int OPEN_PHASE_FILE = 0;
+	public final static int OPEN_PHASE_XREF = 1;
+	public final static int OPEN_PHASE_REPAIR = 2;
+	public final static int OPEN_PHASE_CRYPT = 3;
+	public final static int OPEN_PHASE_LINEARIZATION = 4;
+	public final static int OPEN_PHASE_PAGE_TREE = 5;
+	public final static int OPEN_PHASE_FIRST_PAGE = 6;
+	public final static int OPEN_PHASES = 7;
+	
+	private final static String[] OPEN_PHASE_NAMES = {
+		"file", "xref", "repair", "crypt", "linearization", "page tree", "first page"
+	};
+	
+	/**
+	 * Get time spent in each phase of opening document and bytes read from
+	 * storage during it.
+	 * @return array of 2 * OPEN_PHASES values: time in microseconds and read
+	 * bytes of phase i are at 2*i and 2*i+1, -1 if phase didn't run
+	 */
+	public native long[] getOpenStats();
+	
+	/**
+	 * Format getOpenStats result for logging.
+	 */
+	public String describeOpenStats() {
+		long[] stats = this.getOpenStats();
+		if (stats == null) return "no open stats";
+		StringBuilder sb = new StringBuilder();
+		for(int i = 0; i < OPEN_PHASES; ++i) {
+			if (stats[2*i] < 0) continue;
+			if (sb.length() > 0) sb.append(", ");
+			sb.append(OPEN_PHASE_NAMES[i]).append(": ").append(stats[2*i] / 1000).append(" ms");
+			if (stats[2*i+1] >= 0) sb.append(" ").append(stats[2*i+1] / 1024).append(" kB read");
+		}
+		return sb.toString();
+	}
+	
+	/**
+	 * Image detail of rendered page, from cheapest, see renderPage.
+	 * IMAGES_PLACEHOLDER draws larger images as gray boxes, IMAGES_LOW decodes
+	 * them at reduced resolution where their format allows it and draws
+	 * placeholders otherwise.
+	 */
+	public final static int IMAGES_SKIP = 0;
+	public final static int IMAGES_PLACEHOLDER = 1;
+	public final static int IMAGES_LOW = 2;
+	public final static int IMAGES_FULL = 3;
+	
+	/**
+	 * Anti-aliasing level of rendered page in bits, see renderPage.
+	 * The same level is used for text and graphics. AA_OFF draws them in
+	 * solid colors, which suits e-ink panels, AA_LOW is cheaper for tiles
+	 * that are replaced soon.
+	 */
+	public final static int AA_OFF = 0;
+	public final static int AA_LOW = 2;
+	public final static int AA_FULL = 8;
 	
 	/**
 	 * Render a page.
@@ -396,11 +503,14 @@ public class PDF {
 	 * @param zoom page size scaling
 	 * @param left left edge
 	 * @param right right edge
+	 * @param aaLevel anti-aliasing level (AA_*)
+	 * @param imageDetail one element array, in: wanted image detail (IMAGES_*),
+	 * out: detail of returned bitmap, IMAGES_FULL if no image needed less detail
 	 * @param passes requested size, used for size of resulting bitmap
 	 * @return bytes of bitmap in Androids format
 	 */
-	synchronized public native int[] renderPage(int n, int zoom, int left, int top, 
-			int rotation, boolean skipImages, PDF.Size rect);
+	public native int[] renderPage(int n, int zoom, int left, int top, 
+			int rotation, int aaLevel, int[] imageDetail, PDF.Size rect);
 	
 	/**
 	 * Get PDF page size, store it in size struct, return error code.
@@ -408,22 +518,40 @@ public class PDF {
 	 * @param size size struct that holds result
 	 * @return error code
 	 */
-	synchronized public native int getPageSize(int n, PDF.Size size);
+	public native int getPageSize(int n, PDF.Size size);
+	
+	/**
+	 * Export text of pages firstPage..lastPage (0-based, inclusive) to opened file
+	 * as UTF-8, pages separated by form feed.
+	 * Pages are extracted in parallel in native code.
+	 * @param fd opened, writable file descriptor
+	 * @param listener progress listener, may be null
+	 * @return number of exported pages or -1 on error
+	 */
+	public native int exportText(FileDescriptor fd, int firstPage, int lastPage,
+			ExportProgressListener listener);
 	
 	/**
-	 * Export PDF to a text file.
+	 * Prepare pages for rendering: read and interpret page content and load its
+	 * fonts and images, without rendering anything. Following renderPage calls
+	 * for these pages don't need to interpret them again.
+	 * Takes time and should be called from low priority background thread.
+	 * Only first few pages of list are prepared, so pass nearest first.
+	 * @param pages 0-based page numbers
+	 * @param skipImages true if pages will be rendered with IMAGES_SKIP
+	 * @return number of pages that are ready for rendering
 	 */
-//	synchronized public native void export();
+	public native int prefetchPages(int[] pages, boolean skipImages);
 
 	/**
 	 * Find text on given page, return list of find results.
 	 */
-	synchronized public native List<FindResult> find(String text, int page, int rotation);
+	public native List<FindResult> find(String text, int page, int rotation);
 	
 	/**
 	 * Clear search.
 	 */
-	synchronized public native void clearFindResult();
+	public native void clearFindResult();
 	
 //	/**
 //	 * Find text on page, return find results.
@@ -7,11 +7,17 @@ public class BitmapCacheValue {
 	/* public long millisAdded; */
 	public long millisAccessed;
 	public long priority;
+	/* PDF.IMAGES_* level bitmap was rendered with */
+	public int imageDetail;
+	/* PDF.AA_* level bitmap was rendered with */
+	public int aaLevel;
 	
-	public BitmapCacheValue(Bitmap bitmap, long millisAdded, long priority) {
+	public BitmapCacheValue(Bitmap bitmap, long millisAdded, long priority, int imageDetail, int aaLevel) {
 		this.bitmap = bitmap;
 		/* this.millisAdded = millisAdded; */
 		this.millisAccessed = millisAdded;
 		this.priority = priority;
+		this.imageDetail = imageDetail;
+		this.aaLevel = aaLevel;
 	}
 }
@@ -405,6 +405,7 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
         this.pageNumberTextView.setTextColor(Options.getForeColor(colorMode));
         this.pdfPagesProvider.setExtraCache(1024*1024*Options.getIntFromString(options, Options.PREF_EXTRA_CACHE, 0));
         this.pdfPagesProvider.setOmitImages(options.getBoolean(Options.PREF_OMIT_IMAGES, false));
+        this.pdfPagesProvider.setEink(this.eink);
 		this.pagesView.setColorMode(this.colorMode);		
 		
 		this.pdfPagesProvider.setRenderAhead(options.getBoolean(Options.PREF_RENDER_AHEAD, true));
@@ -1,5 +1,6 @@
 package cx.hell.android.pdfview;
 
+import java.util.Arrays;
 import java.util.Collection;
 import java.util.Collections;
 import java.util.HashMap;
@@ -32,6 +33,9 @@ public class PDFPagesProvider extends PagesProvider {
 	private boolean doRenderAhead = true;
 	private int extraCache = 0;
 	private boolean omitImages;
+	private boolean eink = false;
+	/* view is being flung, see setFlinging */
+	private volatile boolean flinging = false;
 	Activity activity = null;
 	private static final int MB = 1024*1024;
 	
@@ -109,6 +113,48 @@ public class PDFPagesProvider extends PagesProvider {
 		}
 	}
 	
+	/**
+	 * E-ink panels can't show anti-aliasing gradients, so tiles are rendered
+	 * without anti-aliasing.
+	 */
+	public void setEink(boolean eink) {
+		if (this.eink == eink)
+			return;
+		this.eink = eink;
+		
+		if (this.bitmapCache != null) {
+			this.bitmapCache.clearCache();
+		}
+	}
+	
+	/**
+	 * While view is flung, tiles are rendered with cheap images and less
+	 * anti-aliasing, and those tiles are rendered again in full quality once
+	 * they are visible after scrolling stops. Cached tiles are kept meanwhile.
+	 */
+	@Override
+	public void setFlinging(boolean flinging) {
+		this.flinging = flinging;
+	}
+	
+	/**
+	 * Get image detail that tiles should be rendered with now.
+	 * @return one of PDF.IMAGES_*
+	 */
+	private int getImageDetail() {
+		if (this.omitImages) return PDF.IMAGES_SKIP;
+		return this.flinging ? PDF.IMAGES_LOW : PDF.IMAGES_FULL;
+	}
+	
+	/**
+	 * Get anti-aliasing level that tiles should be rendered with now.
+	 * @return one of PDF.AA_*
+	 */
+	private int getAaLevel() {
+		if (this.eink) return PDF.AA_OFF;
+		return this.flinging ? PDF.AA_LOW : PDF.AA_FULL;
+	}
+	
 
 	/**
 	 * Smart page-bitmap cache.
@@ -173,24 +219,33 @@ public class PDFPagesProvider extends PagesProvider {
 		}
 		
 		/**
-		 * Put rendered tile in cache.
+		 * Put rendered tile in cache, replacing the same tile rendered with
+		 * less image detail or anti-aliasing.
+		 * Replaced bitmap is not recycled, since it may be still drawn by view.
 		 * @param tile tile definition (page, position etc), cache key
 		 * @param bitmap rendered tile contents, cache value
+		 * @param imageDetail PDF.IMAGES_* level bitmap was rendered with
+		 * @param aaLevel PDF.AA_* level bitmap was rendered with
 		 */
-		synchronized void put(Tile tile, Bitmap bitmap) {
+		synchronized void put(Tile tile, Bitmap bitmap, int imageDetail, int aaLevel) {
+			this.bitmaps.remove(tile);
 			while (this.willExceedCacheSize(bitmap) && !this.bitmaps.isEmpty()) {
 				Log.v(TAG, "Removing oldest");
 				this.removeOldest();
 			}
-			this.bitmaps.put(tile, new BitmapCacheValue(bitmap, System.currentTimeMillis(), 0));
+			this.bitmaps.put(tile, new BitmapCacheValue(bitmap, System.currentTimeMillis(), 0, imageDetail, aaLevel));
 		}
 		
 		/**
-		 * Check if cache contains specified bitmap tile. Doesn't update last-used timestamp.
+		 * Check if cache contains specified bitmap tile with at least given
+		 * image detail and anti-aliasing. Doesn't update last-used timestamp.
+		 * @param imageDetail PDF.IMAGES_* level
+		 * @param aaLevel PDF.AA_* level
 		 * @return true if cache contains specified bitmap tile
 		 */
-		synchronized boolean contains(Tile tile) {
-			return this.bitmaps.containsKey(tile);
+		synchronized boolean contains(Tile tile, int imageDetail, int aaLevel) {
+			BitmapCacheValue v = this.bitmaps.get(tile);
+			return v != null && v.imageDetail >= imageDetail && v.aaLevel >= aaLevel;
 		}
 		
 		/**
@@ -369,6 +424,33 @@ public class PDFPagesProvider extends PagesProvider {
 	private RendererWorker rendererWorker = null;
 	private OnImageRenderedListener onImageRendererListener = null;
 	
+	/**
+	 * Set when getPageSizes returned estimated sizes.
+	 * Real sizes are loaded after first bitmaps are published.
+	 */
+	private boolean pageSizesEstimated = false;
+	
+	/**
+	 * Number of pages in sizes returned by getPageSizes or passed to
+	 * onPageSizesChanged. Native page count is checked against it after
+	 * bitmaps are published, since page count read before page tree is
+	 * loaded can be wrong in broken files.
+	 */
+	private int pageSizesCount = 0;
+	
+	/**
+	 * Set when open phase times were logged after first bitmaps.
+	 */
+	private boolean openStatsLogged = false;
+	
+	/**
+	 * Pages waiting to be prefetched and last prefetch hint from view.
+	 * Guarded by this.
+	 */
+	private int[] prefetchPages = null;
+	private int[] lastPrefetchPages = null;
+	private Thread prefetchThread = null;
+	
 	public float getRenderAhead() {
 		return this.renderAhead;
 	}
@@ -416,22 +498,25 @@ public class PDFPagesProvider extends PagesProvider {
 	 */
 	private Bitmap renderBitmap(Tile tile) throws RenderingException {
 		synchronized(tile) {
+			int[] imageDetail = { this.getImageDetail() };
+			int aaLevel = this.getAaLevel();
+			
 			/* last minute check to make sure some other thread hasn't rendered this tile */
-			if (this.bitmapCache.contains(tile))
+			if (this.bitmapCache.contains(tile, imageDetail[0], aaLevel))
 				return null;
 			
 			PDF.Size size = new PDF.Size(tile.getPrefXSize(), tile.getPrefYSize());
 			int[] pagebytes = null;
 
 			pagebytes = pdf.renderPage(tile.getPage(), tile.getZoom(), tile.getX(), tile.getY(), 
-					tile.getRotation(), omitImages, size); /* native */
+					tile.getRotation(), aaLevel, imageDetail, size); /* native */
 
 			if (pagebytes == null) throw new RenderingException("Couldn't render page " + tile.getPage());
 			
 			/* create a bitmap from the 32-bit color array */			
 			Bitmap b = Bitmap.createBitmap(pagebytes, size.width, size.height, 
 					Bitmap.Config.RGB_565);
-			this.bitmapCache.put(tile, b);
+			this.bitmapCache.put(tile, b, imageDetail[0], aaLevel);
 			return b;
 		}
 	}
@@ -445,6 +530,85 @@ public class PDFPagesProvider extends PagesProvider {
 		} else {
 			Log.w(TAG, "we've got new bitmaps, but there's no one to notify about it!");
 		}
+		if (!this.openStatsLogged) {
+			this.openStatsLogged = true;
+			Log.i(TAG, "open stats: " + this.pdf.describeOpenStats());
+		}
+		this.startPageSizesLoader(this.pdf.getPageCount());
+	}
+	
+	/**
+	 * Load real page sizes in background if getPageSizes returned estimates
+	 * or if page count was corrected when page tree was loaded.
+	 * Started only after first page is shown, so loading page tree doesn't
+	 * delay it.
+	 * @param pageCount current native page count
+	 */
+	synchronized private void startPageSizesLoader(int pageCount) {
+		if (!this.pageSizesEstimated && (pageCount <= 0 || pageCount == this.pageSizesCount)) return;
+		if (pageCount > 0 && pageCount != this.pageSizesCount) {
+			Log.w(TAG, "page count changed from " + this.pageSizesCount + " to " + pageCount);
+		}
+		this.pageSizesEstimated = false;
+		this.pageSizesCount = pageCount;
+		Thread t = new Thread(new Runnable() {
+			public void run() {
+				int[][] sizes = null;
+				try {
+					sizes = PDFPagesProvider.this.loadPageSizes();
+				} catch (RuntimeException e) {
+					PDFPagesProvider.this.publishRenderingException(new RenderingException(e.getMessage()));
+					return;
+				}
+				synchronized(PDFPagesProvider.this) {
+					PDFPagesProvider.this.pageSizesCount = sizes.length;
+				}
+				if (PDFPagesProvider.this.onImageRendererListener != null) {
+					PDFPagesProvider.this.onImageRendererListener.onPageSizesChanged(sizes);
+				}
+			}
+		});
+		t.setPriority(Thread.MIN_PRIORITY);
+		t.setName("PageSizesLoaderThread");
+		t.start();
+	}
+	
+	/**
+	 * Prepare pages that will be visible soon in background, see PDF.prefetchPages.
+	 * Prefetch thread runs while there are new hints, most recent hint wins.
+	 */
+	@Override
+	synchronized public void setPrefetchPages(int[] pages) {
+		if (pages.length == 0 || Arrays.equals(pages, this.lastPrefetchPages))
+			return;
+		this.lastPrefetchPages = pages;
+		this.prefetchPages = pages;
+		if (this.prefetchThread != null)
+			return;
+		Thread t = new Thread(new Runnable() {
+			public void run() {
+				int[] pages;
+				while((pages = PDFPagesProvider.this.popPrefetchPages()) != null) {
+					PDFPagesProvider.this.pdf.prefetchPages(pages, PDFPagesProvider.this.omitImages);
+				}
+			}
+		});
+		t.setPriority(Thread.MIN_PRIORITY);
+		t.setName("PrefetchThread");
+		this.prefetchThread = t;
+		t.start();
+	}
+	
+	/**
+	 * Called by prefetch thread.
+	 * @return pages to prefetch or null, in which case calling thread must finish
+	 */
+	synchronized private int[] popPrefetchPages() {
+		int[] pages = this.prefetchPages;
+		this.prefetchPages = null;
+		if (pages == null)
+			this.prefetchThread = null;
+		return pages;
 	}
 	
 	/**
@@ -488,26 +652,62 @@ public class PDFPagesProvider extends PagesProvider {
 	
 	/**
 	 * Get page sizes from pdf file.
+	 * For linearized and large files (see PDF.hasFastFirstPage) only first page
+	 * size is read and used for all pages, real sizes are passed to
+	 * onPageSizesChanged when first page is rendered.
 	 * @return array of page sizes
 	 */
 	@Override
 	public int[][] getPageSizes() {
-		int cnt = this.getPageCount();
-		int[][] sizes = new int[cnt][];
-		PDF.Size size = new PDF.Size();
-		int err;
-		for(int i = 0; i < cnt; ++i) {
-			err = this.pdf.getPageSize(i, size);
-			if (err != 0) {
-				throw new RuntimeException("failed to getPageSize(" + i + ",...), error: " + err);
+		if (this.pdf.hasFastFirstPage()) {
+			int cnt = this.getPageCount();
+			int[][] sizes = new int[cnt][];
+			int[] first = this.loadPageSize(0, new PDF.Size());
+			for(int i = 0; i < cnt; ++i) {
+				sizes[i] = new int[] { first[0], first[1] };
+			}
+			synchronized(this) {
+				this.pageSizesEstimated = true;
+				this.pageSizesCount = cnt;
 			}
-			sizes[i] = new int[2];
-			sizes[i][0] = size.width;
-			sizes[i][1] = size.height;
+			return sizes;
+		}
+		int[][] sizes = this.loadPageSizes();
+		synchronized(this) {
+			this.pageSizesCount = sizes.length;
 		}
 		return sizes;
 	}
 	
+	/**
+	 * Get real sizes of all pages.
+	 * If page tree gets loaded meanwhile and page count turns out to be
+	 * wrong, sizes are loaded again for corrected count; that happens at
+	 * most once, since count doesn't change after page tree is loaded.
+	 */
+	private int[][] loadPageSizes() {
+		while(true) {
+			int cnt = this.getPageCount();
+			int[][] sizes = new int[cnt][];
+			PDF.Size size = new PDF.Size();
+			int i = 0;
+			while(i < cnt && this.pdf.getPageSize(i, size) == 0) {
+				sizes[i++] = new int[] { size.width, size.height };
+			}
+			if (this.getPageCount() != cnt) continue;
+			if (i < cnt) this.loadPageSize(i, size); /* throws */
+			return sizes;
+		}
+	}
+	
+	private int[] loadPageSize(int page, PDF.Size size) {
+		int err = this.pdf.getPageSize(page, size);
+		if (err != 0) {
+			throw new RuntimeException("failed to getPageSize(" + page + ",...), error: " + err);
+		}
+		return new int[] { size.width, size.height };
+	}
+	
 	/**
 	 * View informs provider what's currently visible.
 	 * Compute what should be rendered and pass that info to renderer worker thread, possibly waking up worker.
@@ -515,8 +715,10 @@ public class PDFPagesProvider extends PagesProvider {
 	 */
 	synchronized public void setVisibleTiles(Collection<Tile> tiles) {
 		List<Tile> newtiles = null;
+		int imageDetail = this.getImageDetail();
+		int aaLevel = this.getAaLevel();
 		for(Tile tile: tiles) {
-			if (!this.bitmapCache.contains(tile)) {
+			if (!this.bitmapCache.contains(tile, imageDetail, aaLevel)) {
 				if (newtiles == null) newtiles = new LinkedList<Tile>();
 				newtiles.add(tile);
 			}